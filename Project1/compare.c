@@ -0,0 +1,359 @@
+/* compare.c
+ *
+ * This program compares two sets of benchmark results written with the -o
+ * option of the other programs, a baseline and a candidate, and flags the
+ * benchmarks whose latencies got significantly worse.
+ *
+ * Records with the same benchmark name are pooled within each file. For every
+ * benchmark present in both files the raw samples are compared with a
+ * two-sided Mann-Whitney U test, which makes no assumption about the shape of
+ * the latency distribution. A benchmark is reported as a regression if the
+ * difference is significant at the given level and the median grew by more
+ * than the given threshold, and as an improvement in the opposite case.
+ *
+ * The exit status is 0 if no benchmark regressed and 2 if any did, so that the
+ * comparison can gate automated runs.
+ *
+ * Usage: ./compare [-a <alpha>] [-t <threshold %>] <baseline> <candidate>
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+#define ALPHA 0.01
+#define THRESHOLD 5.0
+#define EXIT_REGRESSION 2
+
+/* Names may end in the path of the binary a process benchmark ran */
+#define NAME_LENGTH (PATH_MAX + 64)
+
+/* Uncomment the line below to turn on logging */
+/*
+#define ENABLE_LOG
+*/
+
+/* Pooled samples of one benchmark */
+typedef struct Benchmark
+{
+    char name[NAME_LENGTH];
+    unsigned long long *samples;
+    size_t count, capacity;
+} Benchmark;
+
+/* All benchmarks of one results file, in order of first appearance */
+typedef struct ResultSet
+{
+    Benchmark *benchmarks;
+    int count, capacity;
+    char kernel[256], host[256];
+} ResultSet;
+
+/* A sample tagged with the set it came from, for ranking */
+typedef struct RankedSample
+{
+    unsigned long long value;
+    int candidate;
+} RankedSample;
+
+/* Copy the string value of a JSON field of the record into value. Returns -1
+ * if the field is missing.
+ */
+int readField(const char *record, const char *field, char *value, size_t size)
+{
+    char key[64];
+    const char *start, *end;
+
+    snprintf(key, sizeof(key), "\"%s\":\"", field);
+    if ((start = strstr(record, key)) == NULL) return -1;
+    start += strlen(key);
+
+    /* Find the closing quote, skipping escaped characters */
+    for (end = start; *end != '\0' && *end != '"'; end++)
+    {
+        if (*end == '\\' && end[1] != '\0') end++;
+    }
+    if (end - start >= (long) size) end = start + size - 1;
+
+    memcpy(value, start, end - start);
+    value[end - start] = '\0';
+
+    return 0;
+}
+
+/* Find a benchmark by name, adding it if it is new */
+Benchmark *findBenchmark(ResultSet *set, const char *name)
+{
+    Benchmark *benchmark;
+    int i;
+
+    for (i = 0; i < set->count; i++)
+    {
+        if (!strcmp(set->benchmarks[i].name, name)) return &set->benchmarks[i];
+    }
+
+    if (set->count == set->capacity)
+    {
+        set->capacity = set->capacity ? 2 * set->capacity : 16;
+        set->benchmarks = realloc(set->benchmarks,
+            set->capacity * sizeof(Benchmark));
+        if (set->benchmarks == NULL)
+        {
+            perror("Allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    benchmark = &set->benchmarks[set->count++];
+    memset(benchmark, 0, sizeof(Benchmark));
+    snprintf(benchmark->name, sizeof(benchmark->name), "%s", name);
+
+    return benchmark;
+}
+
+/* Append the samples array of a record to the benchmark */
+void readSamples(Benchmark *benchmark, const char *record)
+{
+    const char *position;
+    char *end;
+    unsigned long long value;
+
+    if ((position = strstr(record, "\"samples\":[")) == NULL) return;
+    position += strlen("\"samples\":[");
+
+    while (*position != ']' && *position != '\0')
+    {
+        value = strtoull(position, &end, 10);
+        if (end == position) break;
+
+        if (benchmark->count == benchmark->capacity)
+        {
+            benchmark->capacity = benchmark->capacity ?
+                2 * benchmark->capacity : 1024;
+            benchmark->samples = realloc(benchmark->samples,
+                benchmark->capacity * sizeof(unsigned long long));
+            if (benchmark->samples == NULL)
+            {
+                perror("Allocation error");
+                exit(EXIT_FAILURE);
+            }
+        }
+        benchmark->samples[benchmark->count++] = value;
+
+        position = end + strspn(end, ", ");
+    }
+}
+
+/* Read every record of a results file into the set */
+void loadResults(const char *path, ResultSet *set)
+{
+    Benchmark *benchmark;
+    FILE *file;
+    char *line = NULL, name[NAME_LENGTH];
+    size_t size = 0;
+
+    memset(set, 0, sizeof(ResultSet));
+    if ((file = fopen(path, "r")) == NULL)
+    {
+        perror("Results file error");
+        exit(EXIT_FAILURE);
+    }
+
+    while (getline(&line, &size, file) != -1)
+    {
+        if (readField(line, "benchmark", name, sizeof(name)) == -1) continue;
+
+        /* Describe the set by the machine of its first record */
+        if (set->count == 0)
+        {
+            readField(line, "kernel", set->kernel, sizeof(set->kernel));
+            readField(line, "host", set->host, sizeof(set->host));
+        }
+
+        benchmark = findBenchmark(set, name);
+        readSamples(benchmark, line);
+
+#ifdef ENABLE_LOG
+        fprintf(stderr, "%s: %s, %zu samples\n", path, name, benchmark->count);
+#endif
+    }
+
+    free(line);
+    fclose(file);
+}
+
+/* Order two ranked samples by value for qsort() */
+int compareRanked(const void *a, const void *b)
+{
+    const RankedSample *x = (const RankedSample *) a;
+    const RankedSample *y = (const RankedSample *) b;
+
+    return x->value < y->value ? -1 : x->value > y->value;
+}
+
+/* Get the two-sided p-value of the Mann-Whitney U test between two sets of
+ * samples, using the normal approximation with tie and continuity correction
+ */
+double mannWhitney(const Benchmark *baseline, const Benchmark *candidate)
+{
+    RankedSample *ranked;
+    double n1 = baseline->count, n2 = candidate->count, n = n1 + n2;
+    double rankSum = 0, ties = 0, rank, u, mean, variance, z;
+    size_t total = baseline->count + candidate->count, i, j, k;
+
+    if ((ranked = malloc(total * sizeof(RankedSample))) == NULL)
+    {
+        perror("Allocation error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < baseline->count; i++)
+    {
+        ranked[i].value = baseline->samples[i];
+        ranked[i].candidate = 0;
+    }
+    for (i = 0; i < candidate->count; i++)
+    {
+        ranked[baseline->count + i].value = candidate->samples[i];
+        ranked[baseline->count + i].candidate = 1;
+    }
+    qsort(ranked, total, sizeof(RankedSample), compareRanked);
+
+    /* Give every group of tied samples the average of their ranks */
+    for (i = 0; i < total; i = j)
+    {
+        for (j = i + 1; j < total && ranked[j].value == ranked[i].value; j++);
+
+        rank = (i + 1 + j) / 2.0;
+        for (k = i; k < j; k++)
+        {
+            if (!ranked[k].candidate) rankSum += rank;
+        }
+        ties += (double) (j - i) * (j - i) * (j - i) - (j - i);
+    }
+    free(ranked);
+
+    u = rankSum - n1 * (n1 + 1) / 2;
+    mean = n1 * n2 / 2;
+    variance = n1 * n2 / 12 * ((n + 1) - ties / (n * (n - 1)));
+    if (variance <= 0) return 1;
+
+    z = (fabs(u - mean) - 0.5) / sqrt(variance);
+    if (z < 0) z = 0;
+
+    return erfc(z / sqrt(2));
+}
+
+/* Get the median of the samples, sorting them in place */
+double median(Benchmark *benchmark)
+{
+    sortSamples(benchmark->samples, benchmark->count);
+
+    return (double) percentile(benchmark->samples, benchmark->count, 50);
+}
+
+int main(int argc, char *argv[])
+{
+    ResultSet baseline, candidate;
+    Benchmark *before, *after;
+    double alpha = ALPHA, threshold = THRESHOLD, p, change, baseMedian;
+    const char *verdict;
+    int regressions = 0, opt, i, j;
+
+    /* Parse the significance level and the regression threshold */
+    while ((opt = getopt(argc, argv, "a:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            if ((alpha = atof(optarg)) <= 0 || alpha >= 1)
+            {
+                fprintf(stderr, "Invalid significance level: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 't':
+            if ((threshold = atof(optarg)) < 0)
+            {
+                fprintf(stderr, "Invalid threshold: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-a <alpha>] [-t <threshold %%>] "
+                "<baseline> <candidate>\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 2)
+    {
+        fprintf(stderr, "Usage: %s [-a <alpha>] [-t <threshold %%>] "
+            "<baseline> <candidate>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    loadResults(argv[optind], &baseline);
+    loadResults(argv[optind + 1], &candidate);
+
+    printf("Baseline:  %s (%s, %s)", argv[optind], baseline.host,
+        baseline.kernel);
+    printf("\nCandidate: %s (%s, %s)", argv[optind + 1], candidate.host,
+        candidate.kernel);
+    printf("\nSignificance level: %g, threshold: %.1f%%", alpha, threshold);
+    printf("\n%-40s %12s %12s %9s %10s %s", "Benchmark", "Base p50",
+        "Cand p50", "Change", "p-value", "Verdict");
+
+    for (i = 0; i < baseline.count; i++)
+    {
+        before = &baseline.benchmarks[i];
+        after = NULL;
+        for (j = 0; j < candidate.count; j++)
+        {
+            if (!strcmp(candidate.benchmarks[j].name, before->name))
+            {
+                after = &candidate.benchmarks[j];
+            }
+        }
+
+        if (after == NULL || before->count == 0 || after->count == 0)
+        {
+            printf("\n%-40s %12s", before->name, "missing");
+            continue;
+        }
+
+        p = mannWhitney(before, after);
+        baseMedian = median(before);
+        change = baseMedian > 0 ?
+            100 * (median(after) - baseMedian) / baseMedian : 0;
+
+        /* Lower latencies are better for every benchmark */
+        verdict = "same";
+        if (p < alpha && change > threshold)
+        {
+            verdict = "REGRESSION";
+            regressions++;
+        }
+        else if (p < alpha && change < -threshold)
+        {
+            verdict = "improved";
+        }
+
+        printf("\n%-40s %12.0f %12.0f %8.1f%% %10.2g %s", before->name,
+            baseMedian, median(after), change, p, verdict);
+    }
+
+    printf("\n%d regression%s\n", regressions, regressions == 1 ? "" : "s");
+
+    for (i = 0; i < baseline.count; i++) free(baseline.benchmarks[i].samples);
+    for (i = 0; i < candidate.count; i++) free(candidate.benchmarks[i].samples);
+    free(baseline.benchmarks);
+    free(candidate.benchmarks);
+
+    return regressions ? EXIT_REGRESSION : EXIT_SUCCESS;
+}
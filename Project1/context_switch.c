@@ -2,169 +2,601 @@
  *
  * This program measures the time required for a context switch.
  *
+ * A parent and a child process play ping-pong over an inter-process transport.
+ * The parent timestamps each message just before handing it to the transport,
+ * and the child replies with the timestamp taken as soon as the message reached
+ * it. The difference is the one-way latency of the transport, which includes
+ * the kernel context switch for the blocking transports. Running every
+ * transport behind the same loop separates the cost of the mechanism from the
+ * cost of the switch itself. Timestamps are exchanged in binary.
+ *
+ * The two processes can be placed on the same CPU, on SMT siblings, on
+ * different cores of one package or on different packages, as read from
+ * /sys/devices/system/cpu. By default they inherit the full affinity mask of
+ * the parent. The sweep option measures every placement and prints a latency
+ * matrix of transports against CPU pair classes. The spin transport is not
+ * measured when both processes share one CPU, where the spinning side only
+ * gives way at the end of its time slice.
+ *
+ * With -P the parent also reads a group of performance counters around every
+ * round trip and reports their per-iteration averages.
+ *
+ * With -o the latency of every message is appended to the given results file,
+ * one record per transport and placement, for the compare program.
+ *
+ * Usage: ./context_switch [-t <transport>] [-n <count>] [-p <placement> | -s]
+ *                         [-P] [-o <results file>]
+ *
  * Author: Asmit De | U72377278
  * Date: 01/27/2016
  */
 
+#include <errno.h>
+#include <linux/futex.h>
 #include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
-#define NANOSECONDS 1000000000
+#include "perfcount.h"
+#include "results.h"
+#include "timer.h"
+#include "topology.h"
+
 #define WRITE_COUNT 1000
 
 /* Uncomment the line below to turn on logging */
-/* 
+/*
 #define ENABLE_LOG
 */
 
-int main()
+/* Relax the pipeline while spinning on a shared-memory word */
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/* Inter-process transports used for the ping-pong exchange */
+typedef enum Transport
 {
-    pid_t pid;
-    struct timespec startTime, endTime;
-    unsigned long long endTimeValue = 0, elapsedTime, totalTime = 0;
-    int pipefd1[2], pipefd2[2], status, i;
-    cpu_set_t mask;
-    char buffer[80];
-    
-    /* Get the affinity mask for the parent process */
-    if (sched_getaffinity(getpid(), sizeof(mask), &mask) == -1)
+    PIPE,
+    EVENTFD,
+    FUTEX,
+    SEMAPHORE,
+    UNIX_STREAM,
+    UNIX_DGRAM,
+    SPIN,
+    NUM_TRANSPORTS
+} Transport;
+
+const char *transportNames[NUM_TRANSPORTS] =
+{
+    "pipe", "eventfd", "futex", "semaphore", "unix-stream", "unix-dgram", "spin"
+};
+
+/* One direction of a shared-memory transport, kept on its own cache line */
+typedef struct Mailbox
+{
+    unsigned long long value;
+    int full;
+    sem_t sem;
+} __attribute__((aligned(64))) Mailbox;
+
+/* The resources one side of the exchange sends and receives through */
+typedef struct Endpoint
+{
+    int sendFd, recvFd;
+    Mailbox *sendBox, *recvBox;
+} Endpoint;
+
+/* Wrapper for the futex system call, which has no glibc stub */
+long futex(int *uaddr, int op, int val)
+{
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+/* Create the resources for a transport and split them between the parent and
+ * the child endpoints. Returns -1 on error.
+ */
+int openTransport(Transport transport, Endpoint *parent, Endpoint *child)
+{
+    Mailbox *boxes;
+    int fds1[2], fds2[2];
+
+    memset(parent, 0, sizeof(Endpoint));
+    memset(child, 0, sizeof(Endpoint));
+    parent->sendFd = parent->recvFd = child->sendFd = child->recvFd = -1;
+
+    switch (transport)
     {
-        perror("Affinity Mask error");
-        exit(EXIT_FAILURE);
+    case PIPE:
+        /* One pipe for each direction */
+        if (pipe(fds1) == -1 || pipe(fds2) == -1) return -1;
+        parent->sendFd = fds1[1];
+        child->recvFd = fds1[0];
+        child->sendFd = fds2[1];
+        parent->recvFd = fds2[0];
+        break;
+
+    case EVENTFD:
+        /* One counter for each direction, shared by both processes */
+        if ((fds1[0] = eventfd(0, 0)) == -1 ||
+            (fds2[0] = eventfd(0, 0)) == -1) return -1;
+        parent->sendFd = child->recvFd = fds1[0];
+        child->sendFd = parent->recvFd = fds2[0];
+        break;
+
+    case UNIX_STREAM:
+    case UNIX_DGRAM:
+        /* A single connected socket pair carries both directions */
+        if (socketpair(AF_UNIX, transport == UNIX_STREAM ? SOCK_STREAM :
+            SOCK_DGRAM, 0, fds1) == -1) return -1;
+        parent->sendFd = parent->recvFd = fds1[0];
+        child->sendFd = child->recvFd = fds1[1];
+        break;
+
+    case FUTEX:
+    case SEMAPHORE:
+    case SPIN:
+        /* One mailbox for each direction in memory shared across the fork */
+        boxes = mmap(NULL, 2 * sizeof(Mailbox), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (boxes == MAP_FAILED) return -1;
+        memset(boxes, 0, 2 * sizeof(Mailbox));
+        if (transport == SEMAPHORE && (sem_init(&boxes[0].sem, 1, 0) == -1 ||
+            sem_init(&boxes[1].sem, 1, 0) == -1)) return -1;
+        parent->sendBox = child->recvBox = &boxes[0];
+        child->sendBox = parent->recvBox = &boxes[1];
+        break;
+
+    default:
+        errno = EINVAL;
+        return -1;
     }
-    
-    /* Create a pipe to send message from parent process to child process */
-    if (pipe(pipefd1) == -1)
+
+    return 0;
+}
+
+/* Release the descriptors of an endpoint that are not used by another one */
+void closeEndpoint(Endpoint *endpoint, Endpoint *other)
+{
+    if (endpoint->sendFd != -1 && endpoint->sendFd != other->sendFd &&
+        endpoint->sendFd != other->recvFd)
     {
-        perror("Pipe error");
-        exit(EXIT_FAILURE);
+        close(endpoint->sendFd);
+    }
+
+    if (endpoint->recvFd != -1 && endpoint->recvFd != endpoint->sendFd &&
+        endpoint->recvFd != other->sendFd && endpoint->recvFd != other->recvFd)
+    {
+        close(endpoint->recvFd);
+    }
+}
+
+/* Hand a value to the other side of the exchange. Returns -1 on error. */
+int sendValue(Transport transport, Endpoint *endpoint, unsigned long long value)
+{
+    Mailbox *box = endpoint->sendBox;
+
+    switch (transport)
+    {
+    case FUTEX:
+        box->value = value;
+        __atomic_store_n(&box->full, 1, __ATOMIC_RELEASE);
+        return futex(&box->full, FUTEX_WAKE, 1) == -1 ? -1 : 0;
+
+    case SEMAPHORE:
+        box->value = value;
+        return sem_post(&box->sem);
+
+    case SPIN:
+        box->value = value;
+        __atomic_store_n(&box->full, 1, __ATOMIC_RELEASE);
+        return 0;
+
+    default:
+        return write(endpoint->sendFd, &value, sizeof(value)) ==
+            sizeof(value) ? 0 : -1;
+    }
+}
+
+/* Wait for a value from the other side of the exchange. Returns -1 on error. */
+int receiveValue(Transport transport, Endpoint *endpoint,
+    unsigned long long *value)
+{
+    Mailbox *box = endpoint->recvBox;
+
+    switch (transport)
+    {
+    case FUTEX:
+        while (__atomic_load_n(&box->full, __ATOMIC_ACQUIRE) == 0)
+        {
+            if (futex(&box->full, FUTEX_WAIT, 0) == -1 && errno != EAGAIN &&
+                errno != EINTR) return -1;
+        }
+        *value = box->value;
+        __atomic_store_n(&box->full, 0, __ATOMIC_RELAXED);
+        return 0;
+
+    case SEMAPHORE:
+        while (sem_wait(&box->sem) == -1)
+        {
+            if (errno != EINTR) return -1;
+        }
+        *value = box->value;
+        return 0;
+
+    case SPIN:
+        while (__atomic_load_n(&box->full, __ATOMIC_ACQUIRE) == 0)
+        {
+            CPU_RELAX();
+        }
+        *value = box->value;
+        __atomic_store_n(&box->full, 0, __ATOMIC_RELAXED);
+        return 0;
+
+    default:
+        return read(endpoint->recvFd, value, sizeof(*value)) ==
+            sizeof(*value) ? 0 : -1;
+    }
+}
+
+/* Measure the average one-way latency of a transport in nanoseconds. If
+ * counters is not NULL, the counts of every round trip are added to
+ * counterTotals. If samples is not NULL, the latency of every message is
+ * stored in it. Returns a negative value on error.
+ */
+double measureTransport(Transport transport, cpu_set_t *parentMask,
+    cpu_set_t *childMask, int writeCount, Counters *counters,
+    unsigned long long *counterTotals, unsigned long long *samples)
+{
+    pid_t pid;
+    Endpoint parent, child;
+    unsigned long long startTime, endTimeValue = 0, elapsedTime, totalTime = 0;
+    unsigned long long countersBefore[NUM_COUNTERS], countersAfter[NUM_COUNTERS];
+    cpu_set_t originalMask;
+    int status, i;
+
+    if (openTransport(transport, &parent, &child) == -1)
+    {
+        perror("Transport error");
+        return -1;
     }
-    
-    /* Create a pipe to send message from child process to parent process */
-    if (pipe(pipefd2) == -1)
+
+    /* Set affinity mask for the parent process, keeping the one it had */
+    if (sched_getaffinity(getpid(), sizeof(cpu_set_t), &originalMask) == -1 ||
+        sched_setaffinity(getpid(), sizeof(cpu_set_t), parentMask) == -1)
     {
-        perror("Pipe error");
+        perror("Affinity Mask error");
         exit(EXIT_FAILURE);
     }
 
     /* Spawn a new process */
     pid = fork();
 
-    /* Get the time tick immediately after creating a new process */
-    clock_gettime(CLOCK_MONOTONIC_RAW, &endTime);
-
     switch (pid)
     {
     case -1:
         perror("Fork error");
         exit(EXIT_FAILURE);
-        
+
     case 0:
 #ifdef ENABLE_LOG
         printf("\nChild process created with pid: %u", getpid());
-#endif        
+#endif
 
         /* Set affinity mask for the child process */
-        if (sched_setaffinity(getpid(), sizeof(mask), &mask) == -1)
+        if (sched_setaffinity(getpid(), sizeof(cpu_set_t), childMask) == -1)
         {
             perror("Affinity Mask error");
             exit(EXIT_FAILURE);
         }
-        
-        /* Close write end of first pipe and read end of second pipe */
-        close(pipefd1[1]);
-        close(pipefd2[0]);
-        
-        /* Read from the first pipe and send acknowledgement to parent*/
-        for (i = 0; i <= WRITE_COUNT; i++)
+
+        /* Release the resources used only by the parent */
+        closeEndpoint(&parent, &child);
+
+        /* Wait for each message and reply with the time it was received */
+        for (i = 0; i <= writeCount; i++)
         {
-            if (read(pipefd1[0], buffer, sizeof(buffer)) > 0)
+            if (receiveValue(transport, &child, &endTimeValue) == -1 ||
+                sendValue(transport, &child, timerEnd()) == -1)
             {
-                /* Get the time tick just after finishing read */
-                clock_gettime(CLOCK_MONOTONIC_RAW, &endTime);
-
-                /* Send the time tick value to parent process through pipe */ 
-                memset(buffer, '\0', sizeof(buffer));
-                sprintf(buffer, "%llu", (unsigned long long) (NANOSECONDS * 
-                    endTime.tv_sec + endTime.tv_nsec));
-                write(pipefd2[1], buffer, sizeof(buffer));
-                memset(buffer, '\0', sizeof(buffer));
+                perror("Child transport error");
+                _exit(EXIT_FAILURE);
             }
         }
 
-        /* Close read end of first pipe and write end of the second pipe */
-        close(pipefd1[0]);
-        close(pipefd2[1]);
-
         /* Close the child process */
+        closeEndpoint(&child, &parent);
         _exit(EXIT_SUCCESS);
 
     default:
-        /* Close read end of first pipe and write end of second pipe */
-        close(pipefd1[0]);
-        close(pipefd2[1]);
+        /* Release the resources used only by the child */
+        closeEndpoint(&child, &parent);
 
-        /* Write to the first pipe and wait for acknowledgement from child */
-        for (i = 0; i <= WRITE_COUNT; i++)
+        /* Send to the child and wait for its timestamp */
+        for (i = 0; i <= writeCount; i++)
         {
-            memset(buffer, '\0', sizeof(buffer));
-            sprintf(buffer, "%d", i);
-            if (write(pipefd1[1], buffer, sizeof(buffer)) > 0)
+            if (counters != NULL) readCounters(counters, countersBefore);
+
+            /* Get the time tick just before handing over the message */
+            startTime = timerStart();
+
+            /* The message is never 0, which would not wake an eventfd reader */
+            if (sendValue(transport, &parent, i + 1) == -1 ||
+                receiveValue(transport, &parent, &endTimeValue) == -1)
             {
-                /* Get the time tick just before waiting to read */
-                clock_gettime(CLOCK_MONOTONIC_RAW, &startTime);
-
-                memset(buffer, '\0', sizeof(buffer));
-                if (read(pipefd2[0], buffer, sizeof(buffer)) > 0)
-                {
-                    /* We skip the 0th iteration as it takes into account the
-                     * time taken to execute the initial code for the child
-                     * including the sched_setaffinity() call and hence gives
-                     * a very inaccurate and high value
-                     */
-                    if (i == 0) continue;
-                    
-                    /* Obtain the end time tick value returned by the child */
-                    sscanf(buffer, "%llu", &endTimeValue);
-
-                    /* Calculate the time taken for context switching */
-                    elapsedTime = endTimeValue - (NANOSECONDS * startTime.tv_sec
-                                    + startTime.tv_nsec);
-
-#ifdef ENABLE_LOG                
-                    printf("\n%llu", elapsedTime);
+                perror("Parent transport error");
+                kill(pid, SIGKILL);
+                break;
+            }
+
+            if (counters != NULL) readCounters(counters, countersAfter);
+
+            /* We skip the 0th iteration as it takes into account the
+             * time taken to execute the initial code for the child
+             * including the sched_setaffinity() call and hence gives
+             * a very inaccurate and high value
+             */
+            if (i == 0) continue;
+
+            /* Calculate the time taken for the message to reach the child */
+            elapsedTime = endTimeValue - startTime;
+
+#ifdef ENABLE_LOG
+            printf("\n%llu", elapsedTime);
 #endif
 
-                    totalTime += elapsedTime;
-                }
+            totalTime += elapsedTime;
+            if (samples != NULL) samples[i - 1] = elapsedTime;
+            if (counters != NULL)
+            {
+                accumulateCounters(countersBefore, countersAfter,
+                    counterTotals);
             }
         }
 
-        /* Close write end of first pipe and read end of second pipe */
-        close(pipefd1[1]);
-        close(pipefd2[0]);
+        closeEndpoint(&parent, &child);
+    }
+
+    /* Release the shared mailboxes, which start at the parent's send box */
+    if (parent.sendBox != NULL)
+    {
+        munmap(parent.sendBox, 2 * sizeof(Mailbox));
+    }
+
+    /* Give the parent back the mask it had before this run */
+    if (sched_setaffinity(getpid(), sizeof(cpu_set_t), &originalMask) == -1)
+    {
+        perror("Affinity Mask error");
+        exit(EXIT_FAILURE);
     }
 
     /* Wait for the child process to finish */
-    if((pid = wait(&status)))
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS || i <= writeCount)
     {
+        fprintf(stderr, "%s: child process failed\n", transportNames[transport]);
+        return -1;
+    }
+
 #ifdef ENABLE_LOG
-        printf("\nChild process %u terminated successfully", pid);
+    printf("\nChild process %u terminated successfully", pid);
 #endif
+
+    return (double) totalTime / writeCount;
+}
+
+int main(int argc, char *argv[])
+{
+    cpu_set_t mask, parentMask, childMask;
+    Counters counters;
+    double averageTime;
+    int writeCount = WRITE_COUNT, transport = -1, placement = INHERIT, sweep = 0;
+    int firstPlacement, lastPlacement, parentCpu, childCpu, opt, t, p;
+    int available[NUM_PLACEMENTS], useCounters = 0;
+    int measured[NUM_TRANSPORTS][NUM_PLACEMENTS];
+    unsigned long long counterTotals[NUM_TRANSPORTS][NUM_PLACEMENTS][NUM_COUNTERS];
+    unsigned long long *samples = NULL;
+    ResultStore store = { NULL };
+    char *resultsPath = NULL, benchmark[64];
+
+    /* Parse the transport selection, the write count and the placement */
+    while ((opt = getopt(argc, argv, "t:n:p:sPo:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            for (transport = 0; transport < NUM_TRANSPORTS; transport++)
+            {
+                if (!strcmp(optarg, transportNames[transport])) break;
+            }
+            if (transport == NUM_TRANSPORTS)
+            {
+                fprintf(stderr, "Unknown transport: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'n':
+            if ((writeCount = atoi(optarg)) <= 0)
+            {
+                fprintf(stderr, "Invalid write count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'p':
+            for (placement = 0; placement < NUM_PLACEMENTS; placement++)
+            {
+                if (!strcmp(optarg, placementNames[placement])) break;
+            }
+            if (placement == NUM_PLACEMENTS)
+            {
+                fprintf(stderr, "Unknown placement: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 's':
+            sweep = 1;
+            break;
+
+        case 'P':
+            useCounters = 1;
+            break;
+
+        case 'o':
+            resultsPath = optarg;
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-t <transport>] [-n <count>] "
+                "[-p <placement> | -s] [-P] [-o <results file>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Get the affinity mask for the parent process */
+    if (sched_getaffinity(getpid(), sizeof(mask), &mask) == -1)
+    {
+        perror("Affinity Mask error");
+        exit(EXIT_FAILURE);
+    }
+
+    /* The sweep covers every CPU pair class, otherwise a single placement */
+    firstPlacement = sweep ? SAME_CPU : placement;
+    lastPlacement = sweep ? NUM_PLACEMENTS - 1 : placement;
+
+    /* Check which of the placements this machine can provide */
+    for (p = firstPlacement; p <= lastPlacement; p++)
+    {
+        available[p] = p == INHERIT ||
+            findCpuPair(&mask, p, &parentCpu, &childCpu) == 0;
+        if (!available[p] && !sweep)
+        {
+            fprintf(stderr, "No CPU pair available for placement: %s\n",
+                placementNames[p]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Calibrate the timer before any child inherits it */
+    initTimer();
+    printTimerInfo();
+
+    /* Count the parent's events around every round trip if requested */
+    memset(measured, 0, sizeof(measured));
+    memset(counterTotals, 0, sizeof(counterTotals));
+    if (useCounters && openCounters(&counters) == 0) useCounters = 0;
+
+    /* Keep the raw latencies of every run if they are to be stored */
+    if (resultsPath != NULL)
+    {
+        if (openResults(&store, resultsPath, "context_switch") == -1)
+        {
+            exit(EXIT_FAILURE);
+        }
+        if ((samples = malloc(sizeof(unsigned long long) * writeCount)) ==
+            NULL)
+        {
+            perror("Allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Run the selected transports behind the same loop for every placement */
+    printf("\nTotal write count: %d", writeCount);
+    printf("\nAverage latency (ns)");
+    printf("\n%-12s", "Transport");
+    for (p = firstPlacement; p <= lastPlacement; p++)
+    {
+        printf(" %13s", placementNames[p]);
+    }
+
+    for (t = 0; t < NUM_TRANSPORTS; t++)
+    {
+        if (transport != -1 && t != transport) continue;
+
+        printf("\n%-12s", transportNames[t]);
+        for (p = firstPlacement; p <= lastPlacement; p++)
+        {
+            if (!available[p])
+            {
+                printf(" %13s", "n/a");
+                continue;
+            }
+
+            /* Build the masks for the parent and the child process */
+            if (p == INHERIT)
+            {
+                parentMask = childMask = mask;
+            }
+            else
+            {
+                findCpuPair(&mask, p, &parentCpu, &childCpu);
+                CPU_ZERO(&parentMask);
+                CPU_SET(parentCpu, &parentMask);
+                CPU_ZERO(&childMask);
+                CPU_SET(childCpu, &childMask);
+            }
+
+            /* Spinning against a process on the same CPU measures the tick */
+            if (t == SPIN && (p == INHERIT ? CPU_COUNT(&mask) == 1 :
+                parentCpu == childCpu))
+            {
+                printf(" %13s", "n/a");
+                continue;
+            }
+
+            averageTime = measureTransport(t, &parentMask, &childMask,
+                writeCount, useCounters ? &counters : NULL,
+                counterTotals[t][p], samples);
+            if (averageTime < 0)
+            {
+                printf(" %13s", "failed");
+            }
+            else
+            {
+                printf(" %13.1f", averageTime);
+                measured[t][p] = writeCount;
+
+                snprintf(benchmark, sizeof(benchmark), "context_switch/%s/%s",
+                    transportNames[t], placementNames[p]);
+                recordSamples(&store, benchmark, samples, writeCount);
+            }
+            fflush(stdout);
+        }
     }
 
-    /* After termination of the child process, calculate the average time taken
-     * for context switching
-     */
-    printf("\nTotal write count: %d", WRITE_COUNT);
-    printf("\nAverage context switching time: %f ns\n", (float) totalTime / 
-        WRITE_COUNT);
+    /* Report the counters of every placement next to the latencies */
+    for (p = firstPlacement; useCounters && p <= lastPlacement; p++)
+    {
+        if (!available[p]) continue;
+
+        printf("\n");
+        printCounterHeader(placementNames[p]);
+        for (t = 0; t < NUM_TRANSPORTS; t++)
+        {
+            if (transport != -1 && t != transport) continue;
+
+            printCounterValues(&counters, transportNames[t],
+                counterTotals[t][p], measured[t][p]);
+        }
+    }
+    if (useCounters) closeCounters(&counters);
+    closeResults(&store);
+    free(samples);
+    printf("\n");
 
     return 0;
 }
-
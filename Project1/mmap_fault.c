@@ -0,0 +1,479 @@
+/* mmap_fault.c
+ *
+ * This program measures the cost of page faults and memory mappings.
+ *
+ * A region of the given size is mapped and then accessed one byte per 4 KB
+ * page, and the time of the timed phase of each method is reported as ns per
+ * 4 KB page and as GB/s:
+ *
+ *   anon-4k     first-touch write faults on anonymous memory with transparent
+ *               huge pages disabled for the region (MADV_NOHUGEPAGE)
+ *   anon-thp    the same on a 2 MB aligned region with MADV_HUGEPAGE, so that
+ *               one fault maps a whole huge page where the kernel permits it
+ *   populate    mmap() with MAP_POPULATE, which faults the region in up front;
+ *               the time of the mmap() call itself
+ *   dontneed    madvise(MADV_DONTNEED) on a touched region, which drops the
+ *               pages at once, followed by the refaults of touching it again
+ *   free        madvise(MADV_FREE) on a touched region, which only marks the
+ *               pages lazily freeable, followed by touching it again
+ *   file-cached read faults on a private mapping of a file in the page cache
+ *   file-cold   read faults on the same file after it was dropped from the
+ *               page cache, which includes the cost of reading the disk
+ *
+ * File mappings benefit from fault-around, which maps several cached pages per
+ * fault. The file is created in the given directory and removed at once; the
+ * cold runs need a filesystem that honours POSIX_FADV_DONTNEED.
+ *
+ * With -P a group of performance counters is read around the timed phase and
+ * their per-iteration averages are reported after the timings. With -o the
+ * time of every iteration is appended to the given results file.
+ *
+ * Usage: ./mmap_fault [-t <method>] [-m <size MB>] [-n <iterations>]
+ *                     [-d <directory>] [-P] [-o <results file>]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "perfcount.h"
+#include "results.h"
+#include "timer.h"
+
+#define REGION_MB 256
+#define NUM_ITERATIONS 5
+#define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define FILL_CHUNK (1024 * 1024)
+
+/* Uncomment the line below to turn on logging */
+/*
+#define ENABLE_LOG
+*/
+
+/* Memory management operations */
+typedef enum Method
+{
+    ANON_4K,
+    ANON_THP,
+    POPULATE,
+    DONTNEED,
+    FREE,
+    FILE_CACHED,
+    FILE_COLD,
+    NUM_METHODS
+} Method;
+
+const char *methodNames[NUM_METHODS] =
+{
+    "anon-4k", "anon-thp", "populate", "dontneed", "free", "file-cached",
+    "file-cold"
+};
+
+/* Figures accumulated over the iterations of one method */
+typedef struct Result
+{
+    unsigned long long elapsedTime, reclaimTime;
+    unsigned long long counterTotals[NUM_COUNTERS];
+    unsigned long long *samples;
+    int count;
+} Result;
+
+/* Write one byte to every page of the region */
+void touchRegion(char *region, size_t size)
+{
+    size_t offset;
+
+    for (offset = 0; offset < size; offset += PAGE_SIZE)
+    {
+        region[offset] = 1;
+    }
+}
+
+/* Read one byte from every page of the region */
+unsigned long readRegion(const volatile char *region, size_t size)
+{
+    unsigned long sum = 0;
+    size_t offset;
+
+    for (offset = 0; offset < size; offset += PAGE_SIZE)
+    {
+        sum += region[offset];
+    }
+
+    return sum;
+}
+
+/* Map an anonymous region aligned to a huge page. The whole mapping is
+ * returned in base and length so that it can be unmapped.
+ */
+char *mapAligned(size_t size, char **base, size_t *length)
+{
+    char *region;
+
+    *length = size + HUGE_PAGE_SIZE;
+    *base = mmap(NULL, *length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (*base == MAP_FAILED) return NULL;
+
+    region = (char *) (((unsigned long) *base + HUGE_PAGE_SIZE - 1) &
+        ~((unsigned long) HUGE_PAGE_SIZE - 1));
+
+    return region;
+}
+
+/* Create an unlinked file of the given size in the directory. Returns its
+ * descriptor, or -1 on error.
+ */
+int createFile(const char *directory, size_t size)
+{
+    char path[4096], *chunk;
+    size_t offset;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/mmap_fault.XXXXXX", directory);
+    if ((fd = mkstemp(path)) == -1)
+    {
+        perror("File creation error");
+        return -1;
+    }
+    unlink(path);
+
+    if ((chunk = malloc(FILL_CHUNK)) == NULL)
+    {
+        perror("Allocation error");
+        exit(EXIT_FAILURE);
+    }
+    memset(chunk, 'x', FILL_CHUNK);
+
+    for (offset = 0; offset < size; offset += FILL_CHUNK)
+    {
+        if (write(fd, chunk, FILL_CHUNK) != FILL_CHUNK)
+        {
+            perror("File write error");
+            free(chunk);
+            close(fd);
+            return -1;
+        }
+    }
+    free(chunk);
+
+    /* Make the pages clean so that they can be dropped for the cold runs */
+    fdatasync(fd);
+
+    return fd;
+}
+
+/* Run one iteration of the method on a region of the given size. The time of
+ * the timed phase is stored in elapsedTime and that of the madvise() call, for
+ * the reclaim methods, in reclaimTime. Returns -1 on error.
+ */
+int runMethod(Method method, size_t size, int fd, Counters *counters,
+    unsigned long long *counterTotals, unsigned long long *elapsedTime,
+    unsigned long long *reclaimTime)
+{
+    unsigned long long countersBefore[NUM_COUNTERS], countersAfter[NUM_COUNTERS];
+    unsigned long long startTime, endTime;
+    char *region = NULL, *base = NULL;
+    size_t length = size;
+    int advice;
+
+    *reclaimTime = 0;
+
+    /* Set up the mapping outside of the timed phase */
+    switch (method)
+    {
+    case ANON_THP:
+        if ((region = mapAligned(size, &base, &length)) == NULL) break;
+        if (madvise(region, size, MADV_HUGEPAGE) == -1)
+        {
+            perror("Huge page advice error");
+        }
+        break;
+
+    case POPULATE:
+        break;
+
+    case FILE_CACHED:
+    case FILE_COLD:
+        /* Drop the file from the page cache, or make sure it is cached */
+        if (method == FILE_COLD &&
+            (errno = posix_fadvise(fd, 0, size, POSIX_FADV_DONTNEED)) != 0)
+        {
+            perror("File advice error");
+        }
+        base = region = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (region == MAP_FAILED) region = NULL;
+        if (region != NULL && method == FILE_CACHED)
+        {
+            readRegion(region, size);
+            munmap(region, size);
+            base = region = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (region == MAP_FAILED) region = NULL;
+        }
+        break;
+
+    default:
+        base = region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED)
+        {
+            region = NULL;
+            break;
+        }
+        if (madvise(region, size, MADV_NOHUGEPAGE) == -1)
+        {
+            perror("Huge page advice error");
+        }
+        if (method == DONTNEED || method == FREE) touchRegion(region, size);
+        break;
+    }
+
+    if (method != POPULATE && region == NULL)
+    {
+        perror("Memory map error");
+        return -1;
+    }
+
+    if (counters != NULL) readCounters(counters, countersBefore);
+
+    /* Get the time tick just before the timed phase */
+    startTime = timerStart();
+
+    switch (method)
+    {
+    case POPULATE:
+        base = region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        break;
+
+    case DONTNEED:
+    case FREE:
+        /* Time the reclaim on its own, then the accesses that follow it */
+        advice = method == DONTNEED ? MADV_DONTNEED : MADV_FREE;
+        if (madvise(region, size, advice) == -1)
+        {
+            perror("Memory advice error");
+        }
+        endTime = timerEnd();
+        *reclaimTime = endTime - startTime;
+        touchRegion(region, size);
+        break;
+
+    case FILE_CACHED:
+    case FILE_COLD:
+        readRegion(region, size);
+        break;
+
+    default:
+        touchRegion(region, size);
+        break;
+    }
+
+    /* Get the time tick just after the timed phase */
+    endTime = timerEnd();
+
+    if (counters != NULL)
+    {
+        readCounters(counters, countersAfter);
+        accumulateCounters(countersBefore, countersAfter, counterTotals);
+    }
+
+    if (region == MAP_FAILED)
+    {
+        perror("Memory map error");
+        return -1;
+    }
+
+    *elapsedTime = endTime - startTime;
+    munmap(base, length);
+
+    return 0;
+}
+
+/* Run every iteration of a method and accumulate the figures */
+void measureMethod(Method method, size_t size, int fd, int numIterations,
+    Counters *counters, Result *result, unsigned long long *samples)
+{
+    unsigned long long elapsedTime, reclaimTime;
+    int i;
+
+    memset(result, 0, sizeof(Result));
+    result->samples = samples;
+
+    for (i = 0; i < numIterations; i++)
+    {
+        if (runMethod(method, size, fd, counters, result->counterTotals,
+            &elapsedTime, &reclaimTime) == -1)
+        {
+            continue;
+        }
+
+#ifdef ENABLE_LOG
+        printf("\n%llu %llu", elapsedTime, reclaimTime);
+#endif
+
+        result->elapsedTime += elapsedTime;
+        result->reclaimTime += reclaimTime;
+        if (result->samples != NULL)
+        {
+            result->samples[result->count] = elapsedTime;
+        }
+        result->count++;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Result results[NUM_METHODS];
+    Counters counters;
+    ResultStore store = { NULL };
+    unsigned long long *samples = NULL;
+    double pages, elapsedTime;
+    long megabytes = REGION_MB;
+    size_t size;
+    int numIterations = NUM_ITERATIONS, method = -1, useCounters = 0;
+    int fd = -1, opt, m;
+    char *directory = ".", *resultsPath = NULL, benchmark[64];
+
+    /* Parse the method selection, the region size and the iteration count */
+    while ((opt = getopt(argc, argv, "t:m:n:d:Po:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            for (method = 0; method < NUM_METHODS; method++)
+            {
+                if (!strcmp(optarg, methodNames[method])) break;
+            }
+            if (method == NUM_METHODS)
+            {
+                fprintf(stderr, "Unknown method: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'm':
+            if ((megabytes = atol(optarg)) <= 0)
+            {
+                fprintf(stderr, "Invalid region size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'n':
+            if ((numIterations = atoi(optarg)) <= 0)
+            {
+                fprintf(stderr, "Invalid iteration count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'd':
+            directory = optarg;
+            break;
+
+        case 'P':
+            useCounters = 1;
+            break;
+
+        case 'o':
+            resultsPath = optarg;
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-t <method>] [-m <size MB>] "
+                "[-n <iterations>] [-d <directory>] [-P] "
+                "[-o <results file>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    size = (size_t) megabytes << 20;
+    pages = (double) size / PAGE_SIZE;
+
+    /* The file methods share one file of the region size */
+    if ((method == -1 || method == FILE_CACHED || method == FILE_COLD) &&
+        (fd = createFile(directory, size)) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    /* Calibrate the timer before taking any measurement */
+    initTimer();
+    printTimerInfo();
+
+    if (useCounters && openCounters(&counters) == 0) useCounters = 0;
+
+    /* Keep the time of every iteration if they are to be stored */
+    if (resultsPath != NULL)
+    {
+        if (openResults(&store, resultsPath, "mmap_fault") == -1)
+        {
+            exit(EXIT_FAILURE);
+        }
+        if ((samples = malloc(sizeof(unsigned long long) * numIterations)) ==
+            NULL)
+        {
+            perror("Allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("\nRegion: %ld MB, iterations per method: %d", megabytes,
+        numIterations);
+    printf("\n%-12s %12s %12s %10s %14s", "Method", "Time (ms)",
+        "ns/page", "GB/s", "madvise (ms)");
+
+    for (m = 0; m < NUM_METHODS; m++)
+    {
+        if (method != -1 && m != method) continue;
+
+        measureMethod(m, size, fd, numIterations,
+            useCounters ? &counters : NULL, &results[m], samples);
+        if (results[m].count == 0)
+        {
+            printf("\n%-12s %12s", methodNames[m], "failed");
+            continue;
+        }
+
+        /* Calculate the average figures for the method */
+        elapsedTime = (double) results[m].elapsedTime / results[m].count;
+        printf("\n%-12s %12.3f %12.1f %10.3f", methodNames[m],
+            elapsedTime / 1000000, elapsedTime / pages, size / elapsedTime);
+        if (m == DONTNEED || m == FREE)
+        {
+            printf(" %14.3f",
+                (double) results[m].reclaimTime / results[m].count / 1000000);
+        }
+        fflush(stdout);
+
+        snprintf(benchmark, sizeof(benchmark), "mmap_fault/%s/%ldMB",
+            methodNames[m], megabytes);
+        recordSamples(&store, benchmark, samples, results[m].count);
+    }
+
+    /* Report the counters of every method next to the timings */
+    if (useCounters)
+    {
+        printf("\n");
+        printCounterHeader("Method");
+        for (m = 0; m < NUM_METHODS; m++)
+        {
+            if (method != -1 && m != method) continue;
+
+            printCounterValues(&counters, methodNames[m],
+                results[m].counterTotals, results[m].count);
+        }
+        closeCounters(&counters);
+    }
+    closeResults(&store);
+    free(samples);
+    if (fd != -1) close(fd);
+    printf("\n");
+
+    return 0;
+}
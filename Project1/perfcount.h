@@ -0,0 +1,199 @@
+/* perfcount.h
+ *
+ * Optional hardware and software counters for the benchmarks, opened with
+ * perf_event_open() as a single group on the calling thread so that all of
+ * them are read with one read() call. Counters the kernel or the machine does
+ * not provide (for example hardware events inside a virtual machine) are
+ * skipped and reported as n/a; the remaining ones still work. The counters are
+ * closed on exec, so children started by the benchmarks do not inherit them.
+ */
+
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#define NUM_COUNTERS 6
+
+static const char *counterNames[NUM_COUNTERS] =
+{
+    "cycles", "instructions", "cache-misses", "dTLB-misses", "ctx-switches",
+    "page-faults"
+};
+
+/* Event type and configuration of each counter */
+static const struct
+{
+    unsigned int type;
+    unsigned long long config;
+} counterEvents[NUM_COUNTERS] =
+{
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS }
+};
+
+/* An open counter group. position[i] is the place of counter i in a group
+ * read, or -1 if the counter is not available.
+ */
+typedef struct Counters
+{
+    int fds[NUM_COUNTERS], position[NUM_COUNTERS];
+    int leader, numOpen;
+} Counters;
+
+/* Open one counter on the calling thread, as a member of the group */
+static int openCounter(int counter, int groupFd, int excludeKernel)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counterEvents[counter].type;
+    attr.config = counterEvents[counter].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = groupFd == -1;
+    attr.exclude_kernel = excludeKernel;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, groupFd,
+        PERF_FLAG_FD_CLOEXEC);
+}
+
+/* Open every available counter in one group and start counting. Kernel-mode
+ * counting is dropped for the whole group if the leader may not count it.
+ * Returns the number of counters opened.
+ */
+static int openCounters(Counters *counters)
+{
+    int excludeKernel = 0, fd, i;
+
+    counters->leader = -1;
+    counters->numOpen = 0;
+
+    for (i = 0; i < NUM_COUNTERS; i++)
+    {
+        counters->fds[i] = counters->position[i] = -1;
+
+        fd = openCounter(i, counters->leader, excludeKernel);
+
+        /* The leader settles whether the group counts in the kernel */
+        if (fd == -1 && errno == EACCES && counters->leader == -1)
+        {
+            excludeKernel = 1;
+            fd = openCounter(i, counters->leader, excludeKernel);
+        }
+        if (fd == -1) continue;
+
+        if (counters->leader == -1) counters->leader = fd;
+        counters->fds[i] = fd;
+        counters->position[i] = counters->numOpen++;
+    }
+
+    if (counters->leader == -1)
+    {
+        fprintf(stderr, "Performance counters unavailable: %s\n",
+            strerror(errno));
+        return 0;
+    }
+
+    ioctl(counters->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counters->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+    return counters->numOpen;
+}
+
+/* Read the current value of every counter with a single group read.
+ * Unavailable counters read as 0. Returns -1 on error.
+ */
+static int readCounters(Counters *counters, unsigned long long *values)
+{
+    unsigned long long buffer[NUM_COUNTERS + 1];
+    int i;
+
+    if (counters->leader == -1 ||
+        read(counters->leader, buffer, sizeof(buffer)) == -1)
+    {
+        memset(values, 0, NUM_COUNTERS * sizeof(unsigned long long));
+        return -1;
+    }
+
+    /* The group read returns the number of counters, then their values */
+    for (i = 0; i < NUM_COUNTERS; i++)
+    {
+        values[i] = counters->position[i] == -1 ? 0 :
+            buffer[1 + counters->position[i]];
+    }
+
+    return 0;
+}
+
+/* Add the counts between two readings to the totals */
+static void accumulateCounters(const unsigned long long *before,
+    const unsigned long long *after, unsigned long long *totals)
+{
+    int i;
+
+    for (i = 0; i < NUM_COUNTERS; i++)
+    {
+        totals[i] += after[i] - before[i];
+    }
+}
+
+/* Close every counter of the group */
+static void closeCounters(Counters *counters)
+{
+    int i;
+
+    for (i = 0; i < NUM_COUNTERS; i++)
+    {
+        if (counters->fds[i] != -1) close(counters->fds[i]);
+    }
+    counters->leader = -1;
+}
+
+/* Print the header of the per-iteration counter table */
+static void printCounterHeader(const char *label)
+{
+    int i;
+
+    printf("\nCounters per iteration");
+    printf("\n%-16s", label);
+    for (i = 0; i < NUM_COUNTERS; i++)
+    {
+        printf(" %13s", counterNames[i]);
+    }
+}
+
+/* Print the per-iteration average of the counter totals */
+static void printCounterValues(Counters *counters, const char *name,
+    const unsigned long long *totals, int iterations)
+{
+    int i;
+
+    printf("\n%-16s", name);
+    for (i = 0; i < NUM_COUNTERS; i++)
+    {
+        if (counters->position[i] == -1 || iterations == 0)
+        {
+            printf(" %13s", "n/a");
+        }
+        else
+        {
+            printf(" %13.1f", (double) totals[i] / iterations);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,470 @@
+/* pipe_throughput.c
+ *
+ * This program measures the throughput of bulk data transfer between a parent
+ * and a child process.
+ *
+ * The parent sends a fixed volume of data to the child in messages of a given
+ * size over a pipe of a given capacity (set with F_SETPIPE_SZ), and the child
+ * reads it into its own buffer. The data is sent with:
+ *
+ *   read/write  write() into the pipe, one copy in and one copy out
+ *   splice      splice() from a memfd in the page cache into the pipe
+ *   vmsplice    vmsplice() of the parent's pages into the pipe in gift mode
+ *   shm-ring    memcpy() through a ring buffer in shared memory of the same
+ *               capacity, with futex wake-ups only when the other side is
+ *               asleep on a full or empty ring
+ *
+ * Message sizes are swept from 64 B to 1 MB and pipe capacities from 4 KB to
+ * 1 MB. For every combination the throughput in GB/s and the CPU time spent by
+ * both processes per byte are reported.
+ *
+ * Usage: ./pipe_throughput [-t <method>] [-s <message bytes>]
+ *                          [-p <capacity bytes>] [-b <total MB>]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "timer.h"
+
+#define MIN_MESSAGE_SIZE 64
+#define MAX_MESSAGE_SIZE (1024 * 1024)
+#define MIN_CAPACITY (4 * 1024)
+#define MAX_CAPACITY (1024 * 1024)
+#define TOTAL_MEGABYTES 64
+#define MAX_MESSAGES 100000
+#define PAGE_SIZE 4096
+
+/* Ways of moving the data into the pipe */
+typedef enum Method
+{
+    READ_WRITE,
+    SPLICE,
+    VMSPLICE,
+    SHM_RING,
+    NUM_METHODS
+} Method;
+
+const char *methodNames[NUM_METHODS] =
+{
+    "read/write", "splice", "vmsplice", "shm-ring"
+};
+
+/* Shared-memory ring of a power of two capacity. The positions count bytes
+ * and wrap around; they are 32-bit so that they can be used as futex words.
+ * Each position has a count of the times the other side went to sleep on it
+ * since it was last woken, so that the side moving it only makes the wake-up
+ * system call when someone is waiting.
+ */
+typedef struct Ring
+{
+    unsigned int head __attribute__((aligned(64)));
+    unsigned int headWaiters;
+    unsigned int tail __attribute__((aligned(64)));
+    unsigned int tailWaiters;
+    unsigned long long endTime __attribute__((aligned(64)));
+    char data[] __attribute__((aligned(64)));
+} Ring;
+
+/* Wrapper for the futex system call, which has no glibc stub */
+long futex(unsigned int *uaddr, int op, unsigned int val)
+{
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+/* Sleep on a position while it still holds the value seen. The waiter count
+ * is raised before the futex checks the position, so a process that moves it
+ * and then finds no waiter can be sure the sleeper will see the new value.
+ */
+void ringWait(unsigned int *position, unsigned int *waiters, unsigned int seen)
+{
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    futex(position, FUTEX_WAIT, seen);
+}
+
+/* Move a position on and wake the process asleep on it, if there is one. The
+ * count is cleared by the wake-up, so the messages that follow before the
+ * woken process runs again make no system call.
+ */
+void ringPost(unsigned int *position, unsigned int *waiters,
+    unsigned int value)
+{
+    __atomic_store_n(position, value, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0 &&
+        __atomic_exchange_n(waiters, 0, __ATOMIC_SEQ_CST) > 0)
+    {
+        futex(position, FUTEX_WAKE, 1);
+    }
+}
+
+/* Copy a message into the ring, waiting for the reader while it is full */
+void ringWrite(Ring *ring, unsigned int capacity, const char *buffer,
+    size_t size)
+{
+    unsigned int head = ring->head, tail, chunk, offset;
+
+    while (size > 0)
+    {
+        while ((tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) +
+            capacity == head)
+        {
+            ringWait(&ring->tail, &ring->tailWaiters, tail);
+        }
+
+        /* Copy as much as fits before the end of the ring or the reader */
+        offset = head & (capacity - 1);
+        chunk = tail + capacity - head;
+        if (chunk > capacity - offset) chunk = capacity - offset;
+        if (chunk > size) chunk = size;
+        memcpy(ring->data + offset, buffer, chunk);
+
+        head += chunk;
+        buffer += chunk;
+        size -= chunk;
+        ringPost(&ring->head, &ring->headWaiters, head);
+    }
+}
+
+/* Copy a message out of the ring, waiting for the writer while it is empty */
+void ringRead(Ring *ring, unsigned int capacity, char *buffer, size_t size)
+{
+    unsigned int tail = ring->tail, head, chunk, offset;
+
+    while (size > 0)
+    {
+        while ((head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) == tail)
+        {
+            ringWait(&ring->head, &ring->headWaiters, head);
+        }
+
+        offset = tail & (capacity - 1);
+        chunk = head - tail;
+        if (chunk > capacity - offset) chunk = capacity - offset;
+        if (chunk > size) chunk = size;
+        memcpy(buffer, ring->data + offset, chunk);
+
+        tail += chunk;
+        buffer += chunk;
+        size -= chunk;
+        ringPost(&ring->tail, &ring->tailWaiters, tail);
+    }
+}
+
+/* Send one message into the pipe with the given method. Returns -1 on error. */
+int sendMessage(Method method, int pipeFd, int memFd, char *buffer,
+    size_t size)
+{
+    struct iovec iov;
+    loff_t offset = 0;
+    ssize_t sent;
+
+    while (size > 0)
+    {
+        switch (method)
+        {
+        case SPLICE:
+            sent = splice(memFd, &offset, pipeFd, NULL, size, SPLICE_F_MOVE);
+            break;
+
+        case VMSPLICE:
+            iov.iov_base = buffer;
+            iov.iov_len = size;
+            sent = vmsplice(pipeFd, &iov, 1, SPLICE_F_GIFT);
+            break;
+
+        default:
+            sent = write(pipeFd, buffer, size);
+            break;
+        }
+
+        if (sent == -1)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buffer += sent;
+        size -= sent;
+    }
+
+    return 0;
+}
+
+/* Read one message of the given size from the pipe. Returns -1 on error. */
+int receiveMessage(int pipeFd, char *buffer, size_t size)
+{
+    ssize_t received;
+
+    while (size > 0)
+    {
+        if ((received = read(pipeFd, buffer, size)) <= 0)
+        {
+            if (received == -1 && errno == EINTR) continue;
+            return -1;
+        }
+        buffer += received;
+        size -= received;
+    }
+
+    return 0;
+}
+
+/* Get the CPU time in nanoseconds from a resource usage report */
+unsigned long long cpuTime(struct rusage *usage)
+{
+    return (unsigned long long) NANOSECONDS * (usage->ru_utime.tv_sec +
+        usage->ru_stime.tv_sec) + 1000ULL * (usage->ru_utime.tv_usec +
+        usage->ru_stime.tv_usec);
+}
+
+/* Transfer the messages from the parent to a child process and report the
+ * throughput in GB/s and the CPU time of both processes in ns per byte.
+ * Returns -1 on error.
+ */
+int measureTransfer(Method method, size_t messageSize, int capacity,
+    long numMessages, double *throughput, double *cpuPerByte)
+{
+    struct rusage parentBefore, parentAfter, childUsage;
+    unsigned long long startTime;
+    Ring *ring;
+    size_t ringSize;
+    char *buffer;
+    int pipefd[2] = { -1, -1 }, memFd = -1, status, failed = 0;
+    long i;
+    pid_t pid;
+
+    /* Page-aligned buffer, as required for gifting pages with vmsplice() */
+    buffer = mmap(NULL, messageSize, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+    {
+        perror("Memory map error");
+        return -1;
+    }
+    memset(buffer, 'x', messageSize);
+
+    /* The ring also carries the child's end time back for every method */
+    ringSize = sizeof(Ring) + (method == SHM_RING ? capacity : 0);
+    ring = mmap(NULL, ringSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED)
+    {
+        perror("Memory map error");
+        munmap(buffer, messageSize);
+        return -1;
+    }
+
+    if (method != SHM_RING)
+    {
+        /* Create the pipe and set its capacity */
+        if (pipe(pipefd) == -1)
+        {
+            perror("Pipe error");
+            munmap(ring, ringSize);
+            munmap(buffer, messageSize);
+            return -1;
+        }
+        if (fcntl(pipefd[1], F_SETPIPE_SZ, capacity) == -1)
+        {
+            perror("Pipe capacity error");
+        }
+
+        /* Keep the message in the page cache for splice() */
+        if (method == SPLICE)
+        {
+            if ((memFd = memfd_create("pipe_throughput", 0)) == -1 ||
+                write(memFd, buffer, messageSize) != (ssize_t) messageSize)
+            {
+                perror("Memory file error");
+                munmap(ring, ringSize);
+                munmap(buffer, messageSize);
+                return -1;
+            }
+        }
+    }
+
+    /* Spawn a new process to receive the data */
+    pid = fork();
+
+    switch (pid)
+    {
+    case -1:
+        perror("Fork error");
+        exit(EXIT_FAILURE);
+
+    case 0:
+        if (pipefd[1] != -1) close(pipefd[1]);
+
+        for (i = 0; i < numMessages; i++)
+        {
+            if (method == SHM_RING)
+            {
+                ringRead(ring, capacity, buffer, messageSize);
+            }
+            else if (receiveMessage(pipefd[0], buffer, messageSize) == -1)
+            {
+                perror("Read error");
+                _exit(EXIT_FAILURE);
+            }
+        }
+
+        /* Store the time the last byte arrived */
+        ring->endTime = timerEnd();
+        _exit(EXIT_SUCCESS);
+
+    default:
+        if (pipefd[0] != -1) close(pipefd[0]);
+    }
+
+    getrusage(RUSAGE_SELF, &parentBefore);
+
+    /* Get the time tick just before sending the first message */
+    startTime = timerStart();
+
+    for (i = 0; i < numMessages; i++)
+    {
+        if (method == SHM_RING)
+        {
+            ringWrite(ring, capacity, buffer, messageSize);
+        }
+        else if (sendMessage(method, pipefd[1], memFd, buffer,
+            messageSize) == -1)
+        {
+            perror("Write error");
+            failed = 1;
+            break;
+        }
+    }
+    if (pipefd[1] != -1) close(pipefd[1]);
+
+    /* Wait for the child to drain the data, and collect its CPU time */
+    if (wait4(pid, &status, 0, &childUsage) == -1 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS)
+    {
+        failed = 1;
+    }
+    getrusage(RUSAGE_SELF, &parentAfter);
+
+    *throughput = (double) numMessages * messageSize /
+        (ring->endTime - startTime);
+    *cpuPerByte = (double) (cpuTime(&parentAfter) - cpuTime(&parentBefore) +
+        cpuTime(&childUsage)) / ((double) numMessages * messageSize);
+
+    if (memFd != -1) close(memFd);
+    munmap(ring, ringSize);
+    munmap(buffer, messageSize);
+
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    double throughput, cpuPerByte;
+    long totalMegabytes = TOTAL_MEGABYTES, numMessages, maxMessages;
+    long size;
+    size_t messageSize, minMessageSize = MIN_MESSAGE_SIZE;
+    size_t maxMessageSize = MAX_MESSAGE_SIZE;
+    int minCapacity = MIN_CAPACITY, maxCapacity = MAX_CAPACITY, capacity;
+    int method = -1, opt, m;
+
+    /* Parse the method, a single message size or capacity, and the volume */
+    while ((opt = getopt(argc, argv, "t:s:p:b:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            for (method = 0; method < NUM_METHODS; method++)
+            {
+                if (!strcmp(optarg, methodNames[method])) break;
+            }
+            if (method == NUM_METHODS)
+            {
+                fprintf(stderr, "Unknown method: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 's':
+            if ((size = atol(optarg)) <= 0)
+            {
+                fprintf(stderr, "Invalid message size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            minMessageSize = maxMessageSize = size;
+            break;
+
+        case 'p':
+            minCapacity = maxCapacity = atoi(optarg);
+            if (minCapacity < PAGE_SIZE || (minCapacity & (minCapacity - 1)))
+            {
+                fprintf(stderr, "Capacity must be a power of two of at least "
+                    "%d: %s\n", PAGE_SIZE, optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'b':
+            if ((totalMegabytes = atol(optarg)) <= 0)
+            {
+                fprintf(stderr, "Invalid total size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-t <method>] [-s <message bytes>] "
+                "[-p <capacity bytes>] [-b <total MB>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Calibrate the timer before any child inherits it */
+    initTimer();
+    printTimerInfo();
+    printf("\nData per measurement: %ld MB (at most %d messages)",
+        totalMegabytes, MAX_MESSAGES);
+    printf("\n%-11s %10s %10s %10s %14s", "Method", "Capacity", "Message",
+        "GB/s", "CPU (ns/B)");
+
+    for (m = 0; m < NUM_METHODS; m++)
+    {
+        if (method != -1 && m != method) continue;
+
+        for (capacity = minCapacity; capacity <= maxCapacity; capacity *= 4)
+        {
+            for (messageSize = minMessageSize; messageSize <= maxMessageSize;
+                 messageSize *= 4)
+            {
+                /* Bound the number of messages for the smallest sizes */
+                numMessages = (totalMegabytes << 20) / messageSize;
+                maxMessages = MAX_MESSAGES;
+                if (numMessages > maxMessages) numMessages = maxMessages;
+                if (numMessages < 1) numMessages = 1;
+
+                if (measureTransfer(m, messageSize, capacity, numMessages,
+                    &throughput, &cpuPerByte) == -1)
+                {
+                    printf("\n%-11s %10d %10zu %10s %14s", methodNames[m],
+                        capacity, messageSize, "failed", "failed");
+                    continue;
+                }
+
+                printf("\n%-11s %10d %10zu %10.3f %14.4f", methodNames[m],
+                    capacity, messageSize, throughput, cpuPerByte);
+                fflush(stdout);
+            }
+        }
+    }
+    printf("\n");
+
+    return 0;
+}
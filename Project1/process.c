@@ -2,89 +2,596 @@
  *
  * This program measures the time required to spawn a new process.
  *
+ * Processes are created with fork(), vfork(), posix_spawn(),
+ * clone(CLONE_VM | CLONE_VFORK) and fork() followed by exec() of a trivial
+ * binary. For each method two figures are reported: the creation latency, up
+ * to the point where the parent may continue, and the time until the child is
+ * running. For fork, vfork and clone the child stores a timestamp as its first
+ * action; for the exec methods the child is running once the exec has
+ * succeeded, which the parent detects through a close-on-exec pipe.
+ *
+ * The cost of copying the parent's page tables grows with its resident set, so
+ * the parent can be made to touch an anonymous region of a given size first,
+ * optionally backed by transparent huge pages. With -m the benchmark sweeps
+ * the region from 0 up to the given size.
+ *
+ * With -c the creation loop runs from 1 up to the given number of threads at
+ * once, each pinned to its own CPU, and the aggregate creations per second and
+ * the creation latency percentiles are reported for every thread count.
+ *
+ * With -P a group of performance counters is read around every creation and
+ * their per-iteration averages are reported after the latencies. The scaling
+ * runner does not read them, so -P cannot be combined with -c.
+ *
+ * With -o the creation and running latencies of every process are appended to
+ * the given results file, for the compare program, under a name that includes
+ * the use of huge pages and, for the exec methods, the binary run. The scaling runner keeps
+ * only percentiles, so -o cannot be combined with -c either.
+ *
+ * Usage: ./process [-t <method>] [-n <count>] [-m <max MB>] [-H] [-e <binary>]
+ *                  [-c <max threads>] [-P] [-o <results file>]
+ *
  * Author: Asmit De | U72377278
  * Date: 01/20/2016
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 
-#define NANOSECONDS 1000000000
+#include "perfcount.h"
+#include "results.h"
+#include "scaling.h"
+#include "timer.h"
+
 #define NUM_PROCESSES 1000
+#define EXEC_BINARY "/bin/true"
+#define RSS_STEP_MB 64
+#define CLONE_STACK_SIZE (64 * 1024)
+#define PAGE_SIZE 4096
 
 /* Uncomment the line below to turn on logging */
 /*
 #define ENABLE_LOG
 */
 
-int main()
+extern char **environ;
+
+/* Process creation methods */
+typedef enum Method
 {
-    pid_t pid;
-    struct timespec startTime, endTime;
-    unsigned long elapsedTime, totalTime = 0;
-    int status, processCounter = 0, i;
+    FORK,
+    VFORK,
+    POSIX_SPAWN,
+    CLONE_VM_VFORK,
+    FORK_EXEC,
+    NUM_METHODS
+} Method;
 
-    for (i = 0; i < NUM_PROCESSES; i++)
+const char *methodNames[NUM_METHODS] =
+{
+    "fork", "vfork", "posix_spawn", "clone", "fork+exec"
+};
+
+/* State of a thread creating children: the method, a stack for clone()
+ * children, the time tick stored by the child as soon as it runs, in memory
+ * shared with the parent, and optional counters with their running totals
+ */
+typedef struct Spawner
+{
+    Method method;
+    char *cloneStack;
+    volatile unsigned long long *childTime;
+    Counters *counters;
+    unsigned long long *counterTotals;
+} Spawner;
+
+/* Binary executed by the exec methods */
+char *execArgs[] = { EXEC_BINARY, NULL };
+
+/* Entry point of a child created with clone() */
+int cloneChild(void *arg)
+{
+    *(volatile unsigned long long *) arg = timerEnd();
+
+    return 0;
+}
+
+/* Create one child with the spawner's method, and reap it. The time until the
+ * parent could continue is stored in createTime and the time until the child
+ * was running in runTime. Returns -1 on error.
+ */
+int spawnChild(Spawner *spawner, unsigned long long *createTime,
+    unsigned long long *runTime)
+{
+    Method method = spawner->method;
+    volatile unsigned long long *childTime = spawner->childTime;
+    pid_t pid = -1;
+    unsigned long long startTime, endTime;
+    unsigned long long countersBefore[NUM_COUNTERS], countersAfter[NUM_COUNTERS];
+    int execPipe[2] = { -1, -1 }, status, error = 0;
+    char byte;
+
+    /* The exec methods report a successful exec by closing this pipe */
+    if ((method == POSIX_SPAWN || method == FORK_EXEC) &&
+        pipe2(execPipe, O_CLOEXEC) == -1)
     {
-        /* Get the time tick just before creating a new process */
-        clock_gettime(CLOCK_MONOTONIC_RAW, &startTime);
+        perror("Pipe error");
+        return -1;
+    }
+    *childTime = 0;
 
-        /* Spawn a new process */
-        pid = fork();
+    if (spawner->counters != NULL)
+    {
+        readCounters(spawner->counters, countersBefore);
+    }
 
-        /* Get the time tick immediately after creating a new process */
-        clock_gettime(CLOCK_MONOTONIC_RAW, &endTime);
+    /* Get the time tick just before creating a new process */
+    startTime = timerStart();
 
-        /* Log the child process creation and terminate the process */
-        if (pid == 0)
+    /* Spawn a new process */
+    switch (method)
+    {
+    case FORK:
+        if ((pid = fork()) == 0)
         {
-#ifdef ENABLE_LOG
-            printf("\nChild process created with pid: %u", getpid());
-#endif
+            *childTime = timerEnd();
             _exit(EXIT_SUCCESS);
         }
-        else if (pid == -1)
+        break;
+
+    case VFORK:
+        if ((pid = vfork()) == 0)
         {
-            perror("Fork error");
-            continue;
+            *childTime = timerEnd();
+            _exit(EXIT_SUCCESS);
         }
-        else
+        break;
+
+    case POSIX_SPAWN:
+        if ((error = posix_spawn(&pid, execArgs[0], NULL, NULL, execArgs,
+            environ)) != 0)
+        {
+            pid = -1;
+        }
+        break;
+
+    case CLONE_VM_VFORK:
+        pid = clone(cloneChild, spawner->cloneStack + CLONE_STACK_SIZE,
+            CLONE_VM | CLONE_VFORK | SIGCHLD, (void *) childTime);
+        break;
+
+    case FORK_EXEC:
+        if ((pid = fork()) == 0)
         {
-            /* Calculate the time elapsed to fork the child process */
-            elapsedTime = NANOSECONDS * (endTime.tv_sec - startTime.tv_sec) + 
-                            (endTime.tv_nsec - startTime.tv_nsec);
+            execv(execArgs[0], execArgs);
+            _exit(127);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    /* Get the time tick immediately after creating a new process */
+    endTime = timerEnd();
+
+    if (spawner->counters != NULL)
+    {
+        readCounters(spawner->counters, countersAfter);
+    }
+
+    if (pid == -1)
+    {
+        if (error) errno = error;
+        perror("Process creation error");
+        if (execPipe[0] != -1)
+        {
+            close(execPipe[0]);
+            close(execPipe[1]);
+        }
+        return -1;
+    }
 
 #ifdef ENABLE_LOG
-            printf("\n%lu", elapsedTime);
+    printf("\nChild process created with pid: %u", pid);
 #endif
 
-            totalTime += elapsedTime;
-            processCounter++;
+    /* Wait for the exec to close the child's copy of the pipe */
+    if (execPipe[0] != -1)
+    {
+        close(execPipe[1]);
+        while (read(execPipe[0], &byte, 1) == -1 && errno == EINTR);
+        *childTime = timerEnd();
+        close(execPipe[0]);
+    }
+
+    /* Reap the child before the next one is created */
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "%s: child process failed\n", methodNames[method]);
+        return -1;
+    }
+
+    *createTime = endTime - startTime;
+    *runTime = *childTime - startTime;
+    if (spawner->counters != NULL)
+    {
+        accumulateCounters(countersBefore, countersAfter,
+            spawner->counterTotals);
+    }
+
+    return 0;
+}
+
+/* Creation loop operation for the scaling runner */
+int spawnOperation(void *context, unsigned long long *latency)
+{
+    unsigned long long runTime;
+
+    return spawnChild((Spawner *) context, latency, &runTime);
+}
+
+/* Measure the scaling curve of a method from 1 up to maxThreads creating
+ * threads, each creating numProcesses children
+ */
+void measureScaling(Spawner *spawners, int maxThreads, int numProcesses)
+{
+    ScalingResult result;
+    void *contexts[maxThreads];
+    int numThreads, i;
+
+    for (i = 0; i < maxThreads; i++)
+    {
+        contexts[i] = &spawners[i];
+    }
+
+    for (numThreads = 1; numThreads <= maxThreads; numThreads++)
+    {
+        if (runScaling(numThreads, numProcesses, spawnOperation, contexts,
+            &result) == -1)
+        {
+            printf("\n%-12s %7d %14s", methodNames[spawners[0].method],
+                numThreads, "failed");
+            continue;
+        }
+        printScalingResult(methodNames[spawners[0].method], numThreads,
+            &result);
+    }
+}
+
+/* Map and touch an anonymous region so that it is part of the resident set */
+char *growResidentSet(size_t size, int hugePages)
+{
+    char *region;
+    size_t offset;
+
+    if (size == 0) return NULL;
+
+    region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+    {
+        perror("Memory map error");
+        exit(EXIT_FAILURE);
+    }
+
+    if (hugePages && madvise(region, size, MADV_HUGEPAGE) == -1)
+    {
+        perror("Huge page advice error");
+    }
+
+    for (offset = 0; offset < size; offset += PAGE_SIZE)
+    {
+        region[offset] = 1;
+    }
+
+    return region;
+}
+
+/* Get the next resident set size of the sweep, doubling from RSS_STEP_MB and
+ * finishing at exactly the maximum. Returns -1 when the sweep is complete.
+ */
+long nextResidentSetSize(long megabytes, long maxMegabytes)
+{
+    if (megabytes >= maxMegabytes) return -1;
+
+    megabytes = megabytes < RSS_STEP_MB ? RSS_STEP_MB : 2 * megabytes;
+
+    return megabytes > maxMegabytes ? maxMegabytes : megabytes;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long long createTime, runTime, totalCreateTime, totalRunTime;
+    unsigned long long *counterTotals = NULL;
+    long maxMegabytes = 0, megabytes;
+    int numProcesses = NUM_PROCESSES, method = -1, hugePages = 0;
+    int maxThreads = 0, numSpawners, processCounter, opt, m, i;
+    int useCounters = 0, numSteps = 0, step;
+    int *measured = NULL;
+    unsigned long long *createSamples = NULL, *runSamples = NULL;
+    char *region, *childTimes, label[32], *resultsPath = NULL;
+    char options[PATH_MAX + 16], benchmark[PATH_MAX + 64];
+    ResultStore store = { NULL };
+    Spawner *spawners;
+    Counters counters;
+
+    /* Parse the method selection, the process count and the RSS sweep */
+    while ((opt = getopt(argc, argv, "t:n:m:He:c:Po:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            for (method = 0; method < NUM_METHODS; method++)
+            {
+                if (!strcmp(optarg, methodNames[method])) break;
+            }
+            if (method == NUM_METHODS)
+            {
+                fprintf(stderr, "Unknown method: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'n':
+            if ((numProcesses = atoi(optarg)) <= 0)
+            {
+                fprintf(stderr, "Invalid process count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'm':
+            if ((maxMegabytes = atol(optarg)) < 0)
+            {
+                fprintf(stderr, "Invalid resident set size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'H':
+            hugePages = 1;
+            break;
+
+        case 'e':
+            execArgs[0] = optarg;
+            break;
+
+        case 'c':
+            if ((maxThreads = atoi(optarg)) <= 0)
+            {
+                fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'P':
+            useCounters = 1;
+            break;
+
+        case 'o':
+            resultsPath = optarg;
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-t <method>] [-n <count>] "
+                "[-m <max MB>] [-H] [-e <binary>] [-c <max threads>] [-P] "
+                "[-o <results file>]\n", argv[0]);
+            exit(EXIT_FAILURE);
         }
     }
 
-    /* Wait for the child processes to finish */
-    for (i = 0; i < processCounter; i++)
+    /* The counters are only read by the measuring thread, not the scaling runner */
+    if (maxThreads && useCounters)
+    {
+        fprintf(stderr, "Performance counters are not available with -c\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Nor does the scaling runner keep the raw latencies the results file needs */
+    if (maxThreads && resultsPath != NULL)
     {
-        if((pid = wait(&status)))
+        fprintf(stderr, "Results files are not available with -c\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Give every creating thread a shared time tick, on its own cache line,
+     * and a stack for clone() children
+     */
+    numSpawners = maxThreads ? maxThreads : 1;
+    spawners = calloc(numSpawners, sizeof(Spawner));
+    childTimes = mmap(NULL, (size_t) numSpawners * 64, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (spawners == NULL || childTimes == MAP_FAILED)
+    {
+        perror("Memory map error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < numSpawners; i++)
+    {
+        spawners[i].childTime = (unsigned long long *) (childTimes + i * 64);
+        spawners[i].cloneStack = mmap(NULL, CLONE_STACK_SIZE,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+            -1, 0);
+        if (spawners[i].cloneStack == MAP_FAILED)
         {
+            perror("Memory map error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Calibrate the timer before taking any measurement */
+    initTimer();
+    printTimerInfo();
+
+    if (maxThreads)
+    {
+        /* Measure the scaling curve with the parent at the requested size */
+        printf("\nResident set: %ld MB", maxMegabytes);
+        printf("\nProcesses created per thread: %d", numProcesses);
+        printScalingHeader();
+        region = growResidentSet((size_t) maxMegabytes << 20, hugePages);
+
+        for (m = 0; m < NUM_METHODS; m++)
+        {
+            if (method != -1 && m != method) continue;
+
+            for (i = 0; i < numSpawners; i++)
+            {
+                spawners[i].method = m;
+            }
+            measureScaling(spawners, maxThreads, numProcesses);
+        }
+        printf("\n");
+
+        return 0;
+    }
+
+    /* Keep counter totals for every step of the sweep and every method */
+    for (megabytes = 0; megabytes != -1;
+         megabytes = nextResidentSetSize(megabytes, maxMegabytes))
+    {
+        numSteps++;
+    }
+    if (useCounters && openCounters(&counters) > 0)
+    {
+        spawners[0].counters = &counters;
+        counterTotals = calloc((size_t) numSteps * NUM_METHODS * NUM_COUNTERS,
+            sizeof(unsigned long long));
+        measured = calloc((size_t) numSteps * NUM_METHODS, sizeof(int));
+        if (counterTotals == NULL || measured == NULL)
+        {
+            perror("Allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Keep the raw latencies of every method if they are to be stored */
+    if (resultsPath != NULL)
+    {
+        if (openResults(&store, resultsPath, "process") == -1)
+        {
+            exit(EXIT_FAILURE);
+        }
+        createSamples = malloc(sizeof(unsigned long long) * numProcesses);
+        runSamples = malloc(sizeof(unsigned long long) * numProcesses);
+        if (createSamples == NULL || runSamples == NULL)
+        {
+            perror("Allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("\nProcesses created per method: %d", numProcesses);
+    printf("\n%10s %-12s %18s %18s", "RSS (MB)", "Method", "Create (ns)",
+        "Child running (ns)");
+
+    /* Grow the parent's resident set from 0 up to the requested size */
+    for (megabytes = 0, step = 0; megabytes != -1;
+         megabytes = nextResidentSetSize(megabytes, maxMegabytes), step++)
+    {
+        region = growResidentSet((size_t) megabytes << 20, hugePages);
+
+        for (m = 0; m < NUM_METHODS; m++)
+        {
+            if (method != -1 && m != method) continue;
+
+            spawners[0].method = m;
+            if (counterTotals != NULL)
+            {
+                spawners[0].counterTotals = counterTotals +
+                    ((size_t) step * NUM_METHODS + m) * NUM_COUNTERS;
+            }
+            totalCreateTime = totalRunTime = 0;
+            processCounter = 0;
+            for (i = 0; i < numProcesses; i++)
+            {
+                if (spawnChild(&spawners[0], &createTime, &runTime) == -1)
+                {
+                    continue;
+                }
+
 #ifdef ENABLE_LOG
-            printf("\nChild process %u terminated successfully", pid);
+                printf("\n%llu %llu", createTime, runTime);
 #endif
+
+                totalCreateTime += createTime;
+                totalRunTime += runTime;
+                if (createSamples != NULL)
+                {
+                    createSamples[processCounter] = createTime;
+                    runSamples[processCounter] = runTime;
+                }
+                processCounter++;
+            }
+
+            if (processCounter == 0)
+            {
+                printf("\n%10ld %-12s %18s %18s", megabytes, methodNames[m],
+                    "failed", "failed");
+                continue;
+            }
+
+            printf("\n%10ld %-12s %18.1f %18.1f", megabytes, methodNames[m],
+                (double) totalCreateTime / processCounter,
+                (double) totalRunTime / processCounter);
+            fflush(stdout);
+            if (measured != NULL)
+            {
+                measured[step * NUM_METHODS + m] = processCounter;
+            }
+
+            /* Name the options that change what the method measures */
+            snprintf(options, sizeof(options), "%s%s%s",
+                hugePages ? "/thp" : "",
+                m == POSIX_SPAWN || m == FORK_EXEC ? "/exec=" : "",
+                m == POSIX_SPAWN || m == FORK_EXEC ? execArgs[0] : "");
+            snprintf(benchmark, sizeof(benchmark), "process/%s/%ldMB%s/create",
+                methodNames[m], megabytes, options);
+            recordSamples(&store, benchmark, createSamples, processCounter);
+            snprintf(benchmark, sizeof(benchmark), "process/%s/%ldMB%s/run",
+                methodNames[m], megabytes, options);
+            recordSamples(&store, benchmark, runSamples, processCounter);
         }
+
+        if (region != NULL) munmap(region, (size_t) megabytes << 20);
     }
 
-    /* After termination of the child processes, calculate the average process 
-     * creation time
-     */
-    printf("\nTotal child processes created: %d", processCounter);
-    printf("\nAverage creation time for each process: %f ns\n",
-       (float) totalTime / processCounter);
+    /* Report the counters of every method and size next to the latencies */
+    if (counterTotals != NULL)
+    {
+        printf("\n");
+        printCounterHeader("Method/RSS (MB)");
+        for (megabytes = 0, step = 0; megabytes != -1;
+             megabytes = nextResidentSetSize(megabytes, maxMegabytes), step++)
+        {
+            for (m = 0; m < NUM_METHODS; m++)
+            {
+                if (method != -1 && m != method) continue;
+
+                snprintf(label, sizeof(label), "%s/%ld", methodNames[m],
+                    megabytes);
+                printCounterValues(&counters, label, counterTotals +
+                    ((size_t) step * NUM_METHODS + m) * NUM_COUNTERS,
+                    measured[step * NUM_METHODS + m]);
+            }
+        }
+        closeCounters(&counters);
+    }
+    closeResults(&store);
+    free(createSamples);
+    free(runSamples);
+    printf("\n");
 
     return 0;
 }
-
@@ -0,0 +1,166 @@
+/* results.h
+ *
+ * Append-only store of benchmark results. Every measurement is written as one
+ * JSON record per line holding the raw samples together with the host, kernel,
+ * CPU model, affinity mask and timer it was taken with, so that runs from
+ * different days or kernels can be compared later with the compare program.
+ * Records are appended under an exclusive lock, so several benchmarks may
+ * write to the same file at once.
+ */
+
+#ifndef RESULTS_H
+#define RESULTS_H
+
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/utsname.h>
+
+#include "timer.h"
+
+/* An open results file and the metadata shared by all its records */
+typedef struct ResultStore
+{
+    FILE *file;
+    char metadata[2048];
+} ResultStore;
+
+/* Copy a string into a JSON string body, escaping quotes and controls */
+static void escapeJson(char *out, size_t size, const char *in)
+{
+    size_t length = 0;
+
+    for (; *in != '\0' && length + 7 < size; in++)
+    {
+        if (*in == '"' || *in == '\\')
+        {
+            out[length++] = '\\';
+            out[length++] = *in;
+        }
+        else if ((unsigned char) *in < 0x20)
+        {
+            length += snprintf(out + length, size - length, "\\u%04x", *in);
+        }
+        else
+        {
+            out[length++] = *in;
+        }
+    }
+    out[length] = '\0';
+}
+
+/* Read the model name of the first CPU from /proc/cpuinfo */
+static void readCpuModel(char *model, size_t size)
+{
+    char line[256], *value;
+    FILE *file;
+
+    snprintf(model, size, "unknown");
+    if ((file = fopen("/proc/cpuinfo", "r")) == NULL) return;
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (strncmp(line, "model name", 10) != 0 ||
+            (value = strchr(line, ':')) == NULL)
+        {
+            continue;
+        }
+        value += strspn(value, ": \t");
+        value[strcspn(value, "\n")] = '\0';
+        snprintf(model, size, "%s", value);
+        break;
+    }
+    fclose(file);
+}
+
+/* Write the affinity mask of the process as a CPU list such as 0-3,6 */
+static void formatAffinity(char *list, size_t size)
+{
+    cpu_set_t mask;
+    size_t length = 0;
+    int cpu, last;
+
+    list[0] = '\0';
+    if (sched_getaffinity(0, sizeof(mask), &mask) == -1) return;
+
+    for (cpu = 0; cpu < CPU_SETSIZE && length < size; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &mask)) continue;
+
+        /* Extend the range while the following CPUs are set */
+        for (last = cpu; last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &mask);
+             last++);
+
+        length += snprintf(list + length, size - length,
+            last == cpu ? "%s%d" : "%s%d-%d", length ? "," : "", cpu, last);
+        cpu = last;
+    }
+}
+
+/* Open the results file for appending and gather the metadata of this run.
+ * Returns -1 on error.
+ */
+static int openResults(ResultStore *store, const char *path,
+    const char *program)
+{
+    struct utsname name;
+    char host[256], kernel[256], model[256], affinity[256], buffer[256];
+
+    if ((store->file = fopen(path, "a")) == NULL)
+    {
+        perror("Results file error");
+        return -1;
+    }
+
+    if (uname(&name) == -1) memset(&name, 0, sizeof(name));
+    escapeJson(host, sizeof(host), name.nodename);
+    snprintf(buffer, sizeof(buffer), "%s %s", name.release, name.version);
+    escapeJson(kernel, sizeof(kernel), buffer);
+    readCpuModel(buffer, sizeof(buffer));
+    escapeJson(model, sizeof(model), buffer);
+    formatAffinity(affinity, sizeof(affinity));
+
+    snprintf(store->metadata, sizeof(store->metadata),
+        "\"program\":\"%s\",\"time\":%ld,\"host\":\"%s\",\"kernel\":\"%s\","
+        "\"cpu\":\"%s\",\"cpus\":%ld,\"affinity\":\"%s\",\"timer\":\"%s\"",
+        program, (long) time(NULL), host, kernel, model,
+        sysconf(_SC_NPROCESSORS_ONLN), affinity,
+        timer.useTsc ? "tsc" : "clock_gettime");
+
+    return 0;
+}
+
+/* Append one record with the raw samples, in nanoseconds, of a benchmark */
+static void recordSamples(ResultStore *store, const char *benchmark,
+    const unsigned long long *samples, size_t count)
+{
+    size_t i;
+
+    if (store == NULL || store->file == NULL || count == 0) return;
+
+    /* Keep the whole record together when several writers share the file */
+    flock(fileno(store->file), LOCK_EX);
+
+    fprintf(store->file, "{\"benchmark\":\"%s\",%s,\"unit\":\"ns\","
+        "\"samples\":[", benchmark, store->metadata);
+    for (i = 0; i < count; i++)
+    {
+        fprintf(store->file, i ? ",%llu" : "%llu", samples[i]);
+    }
+    fprintf(store->file, "]}\n");
+    fflush(store->file);
+
+    flock(fileno(store->file), LOCK_UN);
+}
+
+/* Close the results file */
+static void closeResults(ResultStore *store)
+{
+    if (store->file != NULL) fclose(store->file);
+    store->file = NULL;
+}
+
+#endif
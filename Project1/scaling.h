@@ -0,0 +1,175 @@
+/* scaling.h
+ *
+ * Runs a creation loop from several threads at once, each pinned to its own
+ * CPU of the process affinity mask, to expose contention on mm locks, PID
+ * allocation and the scheduler that a single creating thread never hits. The
+ * caller supplies the operation to repeat; the runner collects the latency of
+ * every operation and the wall time of the whole run.
+ */
+
+#ifndef SCALING_H
+#define SCALING_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stats.h"
+#include "timer.h"
+
+/* Operation repeated by every creating thread. Stores the latency of one
+ * creation and returns -1 on error.
+ */
+typedef int (*ScalingOp)(void *context, unsigned long long *latency);
+
+/* Summary of one run at a given number of creating threads */
+typedef struct ScalingResult
+{
+    double opsPerSecond;
+    unsigned long long p50, p90, p99, max;
+    int count;
+} ScalingResult;
+
+/* State of one creating thread */
+typedef struct ScalingWorker
+{
+    pthread_t thread;
+    pthread_barrier_t *barrier;
+    ScalingOp op;
+    void *context;
+    unsigned long long *latencies;
+    int opsPerThread, count, cpu;
+} ScalingWorker;
+
+/* Creating thread: pin itself, wait for the others, then run the loop */
+static void *scalingRoutine(void *arg)
+{
+    ScalingWorker *worker = (ScalingWorker *) arg;
+    cpu_set_t mask;
+    int i;
+
+    CPU_ZERO(&mask);
+    CPU_SET(worker->cpu, &mask);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) != 0)
+    {
+        fprintf(stderr, "Could not pin creating thread to CPU %d\n",
+            worker->cpu);
+    }
+
+    pthread_barrier_wait(worker->barrier);
+
+    for (i = 0; i < worker->opsPerThread; i++)
+    {
+        if (worker->op(worker->context, &worker->latencies[worker->count]) == 0)
+        {
+            worker->count++;
+        }
+    }
+
+    return NULL;
+}
+
+/* Run the operation opsPerThread times from each of numThreads threads at
+ * once, passing contexts[i] to the i-th thread. Threads are pinned round-robin
+ * over the CPUs of the affinity mask. Returns -1 on error.
+ */
+static int runScaling(int numThreads, int opsPerThread, ScalingOp op,
+    void **contexts, ScalingResult *result)
+{
+    ScalingWorker *workers;
+    pthread_barrier_t barrier;
+    cpu_set_t mask;
+    unsigned long long *samples, startTime, endTime;
+    int cpus[CPU_SETSIZE], numCpus = 0, count = 0, retVal, cpu, i, j;
+
+    /* List the CPUs the threads may be pinned to */
+    if (sched_getaffinity(0, sizeof(mask), &mask) == -1)
+    {
+        perror("Affinity Mask error");
+        return -1;
+    }
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &mask)) cpus[numCpus++] = cpu;
+    }
+
+    workers = calloc(numThreads, sizeof(ScalingWorker));
+    samples = malloc(sizeof(unsigned long long) * numThreads * opsPerThread);
+    if (workers == NULL || samples == NULL)
+    {
+        perror("Allocation error");
+        exit(EXIT_FAILURE);
+    }
+    pthread_barrier_init(&barrier, NULL, numThreads + 1);
+
+    /* Start the creating threads, each with its own part of the samples */
+    for (i = 0; i < numThreads; i++)
+    {
+        workers[i].barrier = &barrier;
+        workers[i].op = op;
+        workers[i].context = contexts[i];
+        workers[i].latencies = samples + (size_t) i * opsPerThread;
+        workers[i].opsPerThread = opsPerThread;
+        workers[i].cpu = cpus[i % numCpus];
+        if ((retVal = pthread_create(&workers[i].thread, NULL, scalingRoutine,
+            &workers[i])) != 0)
+        {
+            errno = retVal;
+            perror("Thread creation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Release all threads at once and wait for the last one to finish */
+    pthread_barrier_wait(&barrier);
+    startTime = timerStart();
+    for (i = 0; i < numThreads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    endTime = timerEnd();
+
+    /* Gather the samples of all threads into one sorted array */
+    for (i = 0; i < numThreads; i++)
+    {
+        for (j = 0; j < workers[i].count; j++)
+        {
+            samples[count++] = workers[i].latencies[j];
+        }
+    }
+    sortSamples(samples, count);
+
+    result->count = count;
+    result->opsPerSecond = (double) count * NANOSECONDS / (endTime - startTime);
+    result->p50 = percentile(samples, count, 50);
+    result->p90 = percentile(samples, count, 90);
+    result->p99 = percentile(samples, count, 99);
+    result->max = count ? samples[count - 1] : 0;
+
+    pthread_barrier_destroy(&barrier);
+    free(samples);
+    free(workers);
+
+    return count ? 0 : -1;
+}
+
+/* Print the header of the scaling curve */
+static void printScalingHeader(void)
+{
+    printf("\n%-12s %7s %14s %12s %12s %12s %12s", "Method", "Threads",
+        "Ops/sec", "p50 (ns)", "p90 (ns)", "p99 (ns)", "max (ns)");
+}
+
+/* Print one point of the scaling curve */
+static void printScalingResult(const char *name, int numThreads,
+    const ScalingResult *result)
+{
+    printf("\n%-12s %7d %14.1f %12llu %12llu %12llu %12llu", name, numThreads,
+        result->opsPerSecond, result->p50, result->p90, result->p99,
+        result->max);
+    fflush(stdout);
+}
+
+#endif
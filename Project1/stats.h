@@ -0,0 +1,45 @@
+/* stats.h
+ *
+ * Helpers to summarize the raw latency samples collected by the benchmarks.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdlib.h>
+
+/* Order two samples for qsort() */
+static int compareSamples(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Sort the samples in ascending order */
+static void sortSamples(unsigned long long *samples, size_t count)
+{
+    qsort(samples, count, sizeof(unsigned long long), compareSamples);
+}
+
+/* Get the sample at the given percentile (0 to 100) of sorted samples,
+ * using the nearest-rank method
+ */
+static unsigned long long percentile(const unsigned long long *sorted,
+    size_t count, double p)
+{
+    double position = p / 100 * count;
+    size_t rank = (size_t) position;
+
+    if (count == 0) return 0;
+
+    /* The rank is the smallest integer not below the position */
+    if (rank < position) rank++;
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+
+    return sorted[rank - 1];
+}
+
+#endif
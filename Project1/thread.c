@@ -2,17 +2,50 @@
  *
  * This program measures the time required to create a new thread.
  *
+ * For threads created per task it reports the time for pthread_create() to
+ * return, the time until start_routine() runs its first instruction, and the
+ * cost of exiting and joining the thread. Threads can be given a specific stack
+ * size, or a stack preallocated with mmap() and reused for every thread.
+ *
+ * The same figures are measured for handing a task to a persistent pool
+ * thread, woken either through a condition variable or a raw futex, to show
+ * when pooling beats creating a thread per task.
+ *
+ * With -c threads are created from 1 up to the given number of threads at
+ * once, each pinned to its own CPU, and the aggregate creations per second and
+ * the creation latency percentiles are reported for every thread count.
+ *
+ * With -P a group of performance counters is read around every task and
+ * their per-iteration averages are reported after the latencies. The scaling
+ * runner does not read them, so -P cannot be combined with -c.
+ *
+ * With -o the total time of every task is appended to the given results file,
+ * for the compare program, under a name that includes the stack options. The scaling runner keeps only percentiles, so -o
+ * cannot be combined with -c either.
+ *
+ * Usage: ./thread [-t <method>] [-n <count>] [-s <stack KB>] [-M]
+ *                 [-c <max threads>] [-P] [-o <results file>]
+ *
  * Author: Asmit De | U72377278
  * Date: 01/21/2016
  */
 
 #include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "perfcount.h"
+#include "results.h"
+#include "scaling.h"
+#include "timer.h"
 
-#define NANOSECONDS 1000000000
 #define NUM_THREADS 1000
 
 /* Uncomment the line below to turn on logging */
@@ -20,83 +53,592 @@
 #define ENABLE_LOG
 */
 
+/* Ways of running a task on another thread */
+typedef enum Method
+{
+    CREATE,
+    POOL_CONDVAR,
+    POOL_FUTEX,
+    NUM_METHODS
+} Method;
+
+const char *methodNames[NUM_METHODS] =
+{
+    "create", "pool-condvar", "pool-futex"
+};
+
+/* Time ticks recorded around a single task */
+typedef struct Task
+{
+    unsigned long long startTime, exitTime;
+} Task;
+
+/* A single persistent worker thread and its hand-off state */
+typedef struct Pool
+{
+    Method method;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t posted, done;
+    int postedFlag, doneFlag, shutdown;
+    Task *task;
+} Pool;
+
+/* Accumulated figures for one method, and optionally the total time of
+ * every task
+ */
+typedef struct Result
+{
+    unsigned long long createTime, startTime, exitTime, totalTime;
+    unsigned long long counterTotals[NUM_COUNTERS];
+    unsigned long long *samples;
+    int count;
+} Result;
+
+/* State of a thread creating threads in the scaling mode */
+typedef struct Creator
+{
+    pthread_attr_t attr;
+    void *stack;
+    Task task;
+    Result result;
+} Creator;
+
 void *start_routine(void *arg);
 
-int main()
+/* Wrapper for the futex system call, which has no glibc stub */
+long futex(int *uaddr, int op, int val)
+{
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+/* Wait until a futex word becomes non-zero, then reset it */
+void futexWaitFlag(int *flag)
+{
+    while (__atomic_load_n(flag, __ATOMIC_ACQUIRE) == 0)
+    {
+        futex(flag, FUTEX_WAIT_PRIVATE, 0);
+    }
+    __atomic_store_n(flag, 0, __ATOMIC_RELAXED);
+}
+
+/* Set a futex word and wake its waiter */
+void futexPostFlag(int *flag)
 {
-    pthread_t threads[NUM_THREADS];
-    struct timespec startTime, endTime;
-    unsigned long elapsedTime, totalTime = 0;
-    int threadCounter = 0, retVal, i;
+    __atomic_store_n(flag, 1, __ATOMIC_RELEASE);
+    futex(flag, FUTEX_WAKE_PRIVATE, 1);
+}
 
-    for (i = 0; i < NUM_THREADS; i++)
+/* Wait until a flag protected by the pool lock becomes non-zero */
+void condWaitFlag(Pool *pool, pthread_cond_t *cond, int *flag)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (*flag == 0)
     {
-        /* Get the time tick just before creating a new thread */
-        clock_gettime(CLOCK_MONOTONIC_RAW, &startTime);
+        pthread_cond_wait(cond, &pool->lock);
+    }
+    *flag = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
 
-        /* Create a new thread */
-        retVal = pthread_create(&threads[i], NULL, start_routine, NULL);
+/* Set a flag protected by the pool lock and wake its waiter */
+void condPostFlag(Pool *pool, pthread_cond_t *cond, int *flag)
+{
+    pthread_mutex_lock(&pool->lock);
+    *flag = 1;
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&pool->lock);
+}
 
-        /* Get the time tick immediately after creating a new thread */
-        clock_gettime(CLOCK_MONOTONIC_RAW, &endTime);
+/* Persistent worker: run every task handed over until shut down */
+void *pool_routine(void *arg)
+{
+    Pool *pool = (Pool *) arg;
 
-        /* Handle thread creation errors */
-        if (retVal != 0)
+    while (1)
+    {
+        if (pool->method == POOL_FUTEX)
         {
-            errno = retVal;
-            perror("Thread creation error");
-            continue;
+            futexWaitFlag(&pool->postedFlag);
+        }
+        else
+        {
+            condWaitFlag(pool, &pool->posted, &pool->postedFlag);
+        }
+
+        if (pool->shutdown) break;
+
+        /* Run the task, recording when it starts and finishes */
+        start_routine(pool->task);
+
+        if (pool->method == POOL_FUTEX)
+        {
+            futexPostFlag(&pool->doneFlag);
+        }
+        else
+        {
+            condPostFlag(pool, &pool->done, &pool->doneFlag);
         }
+    }
+
+    return NULL;
+}
+
+/* Hand a task to the pool thread and wait for it to finish */
+void runOnPool(Pool *pool, Task *task, Result *result)
+{
+    unsigned long long submitTime, postedTime, doneTime;
+
+    pool->task = task;
+
+    /* Get the time ticks around the hand-off of the task */
+    submitTime = timerStart();
+    if (pool->method == POOL_FUTEX)
+    {
+        futexPostFlag(&pool->postedFlag);
+    }
+    else
+    {
+        condPostFlag(pool, &pool->posted, &pool->postedFlag);
+    }
+    postedTime = timerEnd();
+
+    /* Wait for the task to finish */
+    if (pool->method == POOL_FUTEX)
+    {
+        futexWaitFlag(&pool->doneFlag);
+    }
+    else
+    {
+        condWaitFlag(pool, &pool->done, &pool->doneFlag);
+    }
+    doneTime = timerEnd();
+
+    result->createTime += postedTime - submitTime;
+    result->startTime += task->startTime - submitTime;
+    result->exitTime += doneTime - task->exitTime;
+    result->totalTime += doneTime - submitTime;
+    if (result->samples != NULL)
+    {
+        result->samples[result->count] = doneTime - submitTime;
+    }
+    result->count++;
+}
+
+/* Create a thread for the task and join it */
+int runOnThread(pthread_attr_t *attr, Task *task, Result *result)
+{
+    pthread_t thread;
+    unsigned long long startTime, endTime, joinTime;
+    int retVal;
+
+    /* Get the time tick just before creating a new thread */
+    startTime = timerStart();
+
+    /* Create a new thread */
+    retVal = pthread_create(&thread, attr, start_routine, task);
+
+    /* Get the time tick immediately after creating a new thread */
+    endTime = timerEnd();
 
-        /* Calculate the time elapsed to create the thread */
-        elapsedTime = NANOSECONDS * (endTime.tv_sec - startTime.tv_sec) + 
-                        (endTime.tv_nsec - startTime.tv_nsec);
+    /* Handle thread creation errors */
+    if (retVal != 0)
+    {
+        errno = retVal;
+        perror("Thread creation error");
+        return -1;
+    }
+
+    /* Wait for the thread to finish */
+    if ((retVal = pthread_join(thread, NULL)) != 0)
+    {
+        errno = retVal;
+        perror("Thread join error");
+        return -1;
+    }
+    joinTime = timerEnd();
 
 #ifdef ENABLE_LOG
-        printf("\n%lu", elapsedTime);
+    printf("\nThread %lu terminated successfully", (unsigned long) thread);
 #endif
 
-        totalTime += elapsedTime;
-        threadCounter++;
+    result->createTime += endTime - startTime;
+    result->startTime += task->startTime - startTime;
+    result->exitTime += joinTime - task->exitTime;
+    result->totalTime += joinTime - startTime;
+    if (result->samples != NULL)
+    {
+        result->samples[result->count] = joinTime - startTime;
     }
+    result->count++;
+
+    return 0;
+}
+
+/* Initialize thread attributes with the requested stack size, or with a
+ * stack preallocated with mmap(), which is stored in stack
+ */
+void initStackAttr(pthread_attr_t *attr, size_t stackSize, int mmapStack,
+    void **stack)
+{
+    int retVal;
+
+    *stack = NULL;
+    pthread_attr_init(attr);
 
-    /* Wait for all threads to finish */
-    for (i = 0; i < NUM_THREADS; i++)
+    if (mmapStack)
     {
-        /* Skip threads which had not been created */
-        if (!threads[i]) continue;
-        
-        if ((retVal = pthread_join(threads[i], NULL)) == 0)
+        *stack = mmap(NULL, stackSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (*stack == MAP_FAILED)
         {
-#ifdef ENABLE_LOG
-            printf("\nThread %u terminated successfully", 
-                (unsigned int) threads[i]);
-#endif
+            perror("Memory map error");
+            exit(EXIT_FAILURE);
         }
-        else
+        retVal = pthread_attr_setstack(attr, *stack, stackSize);
+    }
+    else
+    {
+        retVal = pthread_attr_setstacksize(attr, stackSize);
+    }
+    if (retVal != 0)
+    {
+        errno = retVal;
+        perror("Thread stack error");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Creation loop operation for the scaling runner */
+int createOperation(void *context, unsigned long long *latency)
+{
+    Creator *creator = (Creator *) context;
+    unsigned long long createTime = creator->result.createTime;
+
+    if (runOnThread(&creator->attr, &creator->task, &creator->result) == -1)
+    {
+        return -1;
+    }
+    *latency = creator->result.createTime - createTime;
+
+    return 0;
+}
+
+/* Measure the scaling curve of thread creation from 1 up to maxThreads
+ * creating threads, each creating numThreads threads
+ */
+void measureScaling(int maxThreads, int numThreads, size_t stackSize,
+    int mmapStack)
+{
+    ScalingResult result;
+    Creator creators[maxThreads];
+    void *contexts[maxThreads];
+    int count, i;
+
+    /* Every creating thread reuses its own stack for the threads it creates */
+    for (i = 0; i < maxThreads; i++)
+    {
+        initStackAttr(&creators[i].attr, stackSize, mmapStack,
+            &creators[i].stack);
+        memset(&creators[i].result, 0, sizeof(Result));
+        contexts[i] = &creators[i];
+    }
+
+    for (count = 1; count <= maxThreads; count++)
+    {
+        if (runScaling(count, numThreads, createOperation, contexts,
+            &result) == -1)
+        {
+            printf("\n%-12s %7d %14s", methodNames[CREATE], count, "failed");
+            continue;
+        }
+        printScalingResult(methodNames[CREATE], count, &result);
+    }
+
+    for (i = 0; i < maxThreads; i++)
+    {
+        pthread_attr_destroy(&creators[i].attr);
+        if (creators[i].stack != NULL) munmap(creators[i].stack, stackSize);
+    }
+}
+
+/* Run the tasks with one method and accumulate the figures. If counters is
+ * not NULL, the counts around every task are added to the result. If samples
+ * is not NULL, the total time of every task is stored in it.
+ */
+void measureMethod(Method method, int numThreads, size_t stackSize,
+    int mmapStack, Counters *counters, Result *result,
+    unsigned long long *samples)
+{
+    pthread_attr_t attr;
+    Pool pool;
+    Task task;
+    void *stack;
+    unsigned long long countersBefore[NUM_COUNTERS], countersAfter[NUM_COUNTERS];
+    int retVal, i;
+
+    memset(result, 0, sizeof(Result));
+    result->samples = samples;
+
+    /* Apply the requested stack size, or a preallocated stack */
+    initStackAttr(&attr, stackSize, mmapStack, &stack);
+
+    if (method == CREATE)
+    {
+        /* Every thread reuses the same stack, as each is joined in turn */
+        for (i = 0; i < numThreads; i++)
+        {
+            if (counters != NULL) readCounters(counters, countersBefore);
+            if (runOnThread(&attr, &task, result) == -1) continue;
+            if (counters != NULL)
+            {
+                readCounters(counters, countersAfter);
+                accumulateCounters(countersBefore, countersAfter,
+                    result->counterTotals);
+            }
+        }
+    }
+    else
+    {
+        /* Start the persistent worker once, then hand every task to it */
+        memset(&pool, 0, sizeof(Pool));
+        pool.method = method;
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.posted, NULL);
+        pthread_cond_init(&pool.done, NULL);
+        if ((retVal = pthread_create(&pool.thread, &attr, pool_routine,
+            &pool)) != 0)
         {
             errno = retVal;
-            perror("Thread join error");
+            perror("Thread creation error");
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < numThreads; i++)
+        {
+            if (counters != NULL) readCounters(counters, countersBefore);
+            runOnPool(&pool, &task, result);
+            if (counters != NULL)
+            {
+                readCounters(counters, countersAfter);
+                accumulateCounters(countersBefore, countersAfter,
+                    result->counterTotals);
+            }
         }
+
+        /* Shut the worker down */
+        pool.shutdown = 1;
+        if (method == POOL_FUTEX)
+        {
+            futexPostFlag(&pool.postedFlag);
+        }
+        else
+        {
+            condPostFlag(&pool, &pool.posted, &pool.postedFlag);
+        }
+        pthread_join(pool.thread, NULL);
+        pthread_mutex_destroy(&pool.lock);
+        pthread_cond_destroy(&pool.posted);
+        pthread_cond_destroy(&pool.done);
     }
 
-    /* After termination of the threads, calculate the average thread creation
-     * time
-     */
-    printf("\nTotal threads created: %d", threadCounter);
-    printf("\nAverage creation time for each thread: %f ns\n", 
-        (float) totalTime / threadCounter);
+    pthread_attr_destroy(&attr);
+    if (stack != NULL) munmap(stack, stackSize);
+}
+
+int main(int argc, char *argv[])
+{
+    Result results[NUM_METHODS];
+    Counters counters;
+    size_t stackSize = 0;
+    int numThreads = NUM_THREADS, method = -1, mmapStack = 0, maxThreads = 0;
+    int useCounters = 0, opt, m;
+    pthread_attr_t attr;
+    unsigned long long *samples = NULL;
+    ResultStore store = { NULL };
+    char *resultsPath = NULL, benchmark[64];
+
+    /* Parse the method selection, the thread count and the stack options */
+    while ((opt = getopt(argc, argv, "t:n:s:Mc:Po:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            for (method = 0; method < NUM_METHODS; method++)
+            {
+                if (!strcmp(optarg, methodNames[method])) break;
+            }
+            if (method == NUM_METHODS)
+            {
+                fprintf(stderr, "Unknown method: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'n':
+            if ((numThreads = atoi(optarg)) <= 0)
+            {
+                fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 's':
+            if (atol(optarg) <= 0 ||
+                (stackSize = (size_t) atol(optarg) * 1024) < PTHREAD_STACK_MIN)
+            {
+                fprintf(stderr, "Invalid stack size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'M':
+            mmapStack = 1;
+            break;
+
+        case 'c':
+            if ((maxThreads = atoi(optarg)) <= 0)
+            {
+                fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'P':
+            useCounters = 1;
+            break;
+
+        case 'o':
+            resultsPath = optarg;
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-t <method>] [-n <count>] "
+                "[-s <stack KB>] [-M] [-c <max threads>] [-P] "
+                "[-o <results file>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* The counters are only read by the measuring thread, not the scaling runner */
+    if (maxThreads && useCounters)
+    {
+        fprintf(stderr, "Performance counters are not available with -c\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Nor does the scaling runner keep the raw latencies the results file needs */
+    if (maxThreads && resultsPath != NULL)
+    {
+        fprintf(stderr, "Results files are not available with -c\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Use the default stack size of the system unless one is given */
+    if (stackSize == 0)
+    {
+        pthread_attr_init(&attr);
+        pthread_attr_getstacksize(&attr, &stackSize);
+        pthread_attr_destroy(&attr);
+    }
+
+    /* Calibrate the timer before taking any measurement */
+    initTimer();
+    printTimerInfo();
+    printf("\nStack: %zu KB%s", stackSize / 1024,
+        mmapStack ? ", preallocated with mmap" : "");
+
+    /* Only thread creation itself is measured in the scaling mode */
+    if (maxThreads)
+    {
+        printf("\nThreads created per creating thread: %d", numThreads);
+        printScalingHeader();
+        measureScaling(maxThreads, numThreads, stackSize, mmapStack);
+        printf("\n");
+
+        return 0;
+    }
+
+    /* Count the events of the measuring thread around every task */
+    if (useCounters && openCounters(&counters) == 0) useCounters = 0;
+
+    /* Keep the raw task times of every method if they are to be stored */
+    if (resultsPath != NULL)
+    {
+        if (openResults(&store, resultsPath, "thread") == -1)
+        {
+            exit(EXIT_FAILURE);
+        }
+        if ((samples = malloc(sizeof(unsigned long long) * numThreads)) ==
+            NULL)
+        {
+            perror("Allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("\nTasks per method: %d", numThreads);
+    printf("\n%-13s %14s %14s %14s %14s", "Method", "Create (ns)",
+        "Start (ns)", "Exit/join (ns)", "Total (ns)");
+
+    for (m = 0; m < NUM_METHODS; m++)
+    {
+        if (method != -1 && m != method) continue;
+
+        measureMethod(m, numThreads, stackSize, mmapStack,
+            useCounters ? &counters : NULL, &results[m], samples);
+        if (results[m].count == 0)
+        {
+            printf("\n%-13s %14s", methodNames[m], "failed");
+            continue;
+        }
+
+        /* Calculate the average figures for the method */
+        printf("\n%-13s %14.1f %14.1f %14.1f %14.1f", methodNames[m],
+            (double) results[m].createTime / results[m].count,
+            (double) results[m].startTime / results[m].count,
+            (double) results[m].exitTime / results[m].count,
+            (double) results[m].totalTime / results[m].count);
+        fflush(stdout);
+
+        snprintf(benchmark, sizeof(benchmark), "thread/%s/stack=%zuK%s/total",
+            methodNames[m], stackSize / 1024, mmapStack ? "/mmap" : "");
+        recordSamples(&store, benchmark, samples, results[m].count);
+    }
+
+    /* Report the counters of every method next to the latencies */
+    if (useCounters)
+    {
+        printf("\n");
+        printCounterHeader("Method");
+        for (m = 0; m < NUM_METHODS; m++)
+        {
+            if (method != -1 && m != method) continue;
+
+            printCounterValues(&counters, methodNames[m],
+                results[m].counterTotals, results[m].count);
+        }
+        closeCounters(&counters);
+    }
+    closeResults(&store);
+    free(samples);
+    printf("\n");
 
     return 0;
 }
 
-/* Thread routine */
+/* Thread routine: record when the task starts and when it is about to exit */
 void *start_routine(void *arg)
 {
+    Task *task = (Task *) arg;
+
+    task->startTime = timerEnd();
+
 #ifdef ENABLE_LOG
-    printf("\nThread created with tid: %u", (unsigned int) pthread_self());
+    printf("\nThread created with tid: %lu", (unsigned long) pthread_self());
 #endif
 
-    pthread_exit(EXIT_SUCCESS);
-}
+    task->exitTime = timerEnd();
 
+    return NULL;
+}
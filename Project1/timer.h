@@ -0,0 +1,178 @@
+/* timer.h
+ *
+ * Low-overhead timing backend for the benchmarks. On x86 processors with an
+ * invariant TSC the time stamp counter is read with rdtsc/rdtscp, fenced so
+ * that the timed code cannot be reordered around the reads, and converted to
+ * nanoseconds using a calibration against CLOCK_MONOTONIC_RAW taken at
+ * startup. Elsewhere, or when the environment variable TIMER_BACKEND is set to
+ * "clock", clock_gettime(CLOCK_MONOTONIC_RAW) is used instead.
+ *
+ * The invariant TSC runs at the same rate on every core and keeps running in
+ * deep sleep states, so readings taken by a parent and a forked child on
+ * different CPUs can be compared directly.
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define TIMER_HAVE_TSC
+#endif
+
+#define NANOSECONDS 1000000000
+#define TIMER_CALIBRATION_NS 50000000
+#define TIMER_OVERHEAD_SAMPLES 100000
+
+/* Calibration of the timing backend, inherited by forked children */
+static struct
+{
+    int useTsc;
+    unsigned long long tscBase, nsBase;
+    unsigned long long mult;        /* nanoseconds per tick in 32.32 fixed point */
+    double ticksPerNs, overhead;
+} timer;
+
+/* Read CLOCK_MONOTONIC_RAW in nanoseconds */
+static inline unsigned long long readClock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+    return (unsigned long long) NANOSECONDS * now.tv_sec + now.tv_nsec;
+}
+
+#ifdef TIMER_HAVE_TSC
+/* Check CPUID for a TSC that is constant-rate and does not stop */
+static int hasInvariantTsc(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) return 0;
+
+    return (edx >> 8) & 1;
+}
+
+/* Convert a TSC reading to nanoseconds on the CLOCK_MONOTONIC_RAW time line */
+static inline unsigned long long tscToNs(unsigned long long tsc)
+{
+    return timer.nsBase + (unsigned long long)
+        (((unsigned __int128) (tsc - timer.tscBase) * timer.mult) >> 32);
+}
+#endif
+
+/* Get the time tick at the start of a timed region. Later instructions do not
+ * start executing before the counter is read.
+ */
+static inline unsigned long long timerStart(void)
+{
+#ifdef TIMER_HAVE_TSC
+    unsigned long long tsc;
+
+    if (timer.useTsc)
+    {
+        _mm_lfence();
+        tsc = __rdtsc();
+        _mm_lfence();
+        return tscToNs(tsc);
+    }
+#endif
+
+    return readClock();
+}
+
+/* Get the time tick at the end of a timed region. The counter is read only
+ * after all earlier instructions have completed.
+ */
+static inline unsigned long long timerEnd(void)
+{
+#ifdef TIMER_HAVE_TSC
+    unsigned long long tsc;
+    unsigned int aux;
+
+    if (timer.useTsc)
+    {
+        tsc = __rdtscp(&aux);
+        _mm_lfence();
+        return tscToNs(tsc);
+    }
+#endif
+
+    return readClock();
+}
+
+/* Measure the average cost of an empty timed region in nanoseconds */
+static double measureTimerOverhead(void)
+{
+    unsigned long long startTime, total = 0;
+    int i;
+
+    for (i = 0; i < TIMER_OVERHEAD_SAMPLES; i++)
+    {
+        startTime = timerStart();
+        total += timerEnd() - startTime;
+    }
+
+    return (double) total / TIMER_OVERHEAD_SAMPLES;
+}
+
+/* Select and calibrate the timing backend. Must be called before any timing,
+ * and before forking processes that share timestamps with the parent.
+ */
+static void initTimer(void)
+{
+    const char *backend = getenv("TIMER_BACKEND");
+#ifdef TIMER_HAVE_TSC
+    unsigned long long tscEnd, nsEnd;
+#endif
+
+    timer.useTsc = 0;
+
+#ifdef TIMER_HAVE_TSC
+    if (hasInvariantTsc() && (backend == NULL || strcmp(backend, "clock")))
+    {
+        /* Count ticks over a fixed stretch of CLOCK_MONOTONIC_RAW */
+        timer.nsBase = readClock();
+        timer.tscBase = __rdtsc();
+        while ((nsEnd = readClock()) - timer.nsBase < TIMER_CALIBRATION_NS);
+        tscEnd = __rdtsc();
+
+        timer.ticksPerNs = (double) (tscEnd - timer.tscBase) /
+            (nsEnd - timer.nsBase);
+        timer.mult = (unsigned long long) ((double) (1ULL << 32) /
+            timer.ticksPerNs);
+        timer.useTsc = 1;
+    }
+#endif
+
+    if (!timer.useTsc && backend != NULL && !strcmp(backend, "tsc"))
+    {
+        fprintf(stderr, "Invariant TSC not available, using clock_gettime\n");
+    }
+
+    timer.overhead = measureTimerOverhead();
+}
+
+/* Print the selected backend and its measured overhead */
+static void printTimerInfo(void)
+{
+    if (timer.useTsc)
+    {
+        printf("\nTimer: invariant TSC at %.3f GHz", timer.ticksPerNs);
+    }
+    else
+    {
+        printf("\nTimer: clock_gettime(CLOCK_MONOTONIC_RAW)");
+    }
+    printf("\nTimer overhead: %.1f ns (included in every measurement)",
+        timer.overhead);
+}
+
+#endif
@@ -0,0 +1,119 @@
+/* topology.h
+ *
+ * Helpers to read the CPU topology from /sys/devices/system/cpu and to pick
+ * pairs of CPUs with a given relationship (same CPU, SMT siblings, different
+ * cores of one package, different packages) for placing benchmark processes.
+ */
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <sched.h>
+#include <stdio.h>
+
+#define SYSFS_CPU_PATH "/sys/devices/system/cpu"
+
+/* Relationship between the CPUs two processes are placed on */
+typedef enum Placement
+{
+    INHERIT,
+    SAME_CPU,
+    SMT_SIBLING,
+    CROSS_CORE,
+    CROSS_SOCKET,
+    NUM_PLACEMENTS
+} Placement;
+
+static const char *placementNames[NUM_PLACEMENTS] =
+{
+    "inherit", "same-cpu", "smt-sibling", "cross-core", "cross-socket"
+};
+
+/* Location of a single logical CPU */
+typedef struct CpuTopology
+{
+    int cpu, core, package;
+} CpuTopology;
+
+/* Read an integer attribute of a CPU from sysfs. Returns -1 on error. */
+static int readCpuAttribute(int cpu, const char *attribute)
+{
+    char path[128];
+    FILE *file;
+    int value = -1;
+
+    snprintf(path, sizeof(path), SYSFS_CPU_PATH "/cpu%d/topology/%s", cpu,
+        attribute);
+    if ((file = fopen(path, "r")) == NULL) return -1;
+    if (fscanf(file, "%d", &value) != 1) value = -1;
+    fclose(file);
+
+    return value;
+}
+
+/* Read the topology of every CPU in the mask into cpus, which must hold
+ * CPU_SETSIZE entries. CPUs whose topology is not exported are treated as
+ * separate cores of package 0. Returns the number of CPUs read.
+ */
+static int readTopology(const cpu_set_t *mask, CpuTopology *cpus)
+{
+    int cpu, count = 0;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, mask)) continue;
+
+        cpus[count].cpu = cpu;
+        if ((cpus[count].core = readCpuAttribute(cpu, "core_id")) == -1)
+        {
+            cpus[count].core = cpu;
+        }
+        if ((cpus[count].package = readCpuAttribute(cpu,
+            "physical_package_id")) == -1)
+        {
+            cpus[count].package = 0;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+/* Classify the relationship between two CPUs */
+static Placement classifyCpus(const CpuTopology *a, const CpuTopology *b)
+{
+    if (a->cpu == b->cpu) return SAME_CPU;
+    if (a->package != b->package) return CROSS_SOCKET;
+    if (a->core != b->core) return CROSS_CORE;
+
+    return SMT_SIBLING;
+}
+
+/* Find the first pair of CPUs in the mask with the requested relationship and
+ * store their numbers in first and second. Returns -1 if there is no such
+ * pair, or if the placement is INHERIT.
+ */
+static int findCpuPair(const cpu_set_t *mask, Placement placement, int *first,
+    int *second)
+{
+    CpuTopology cpus[CPU_SETSIZE];
+    int count, i, j;
+
+    count = readTopology(mask, cpus);
+    for (i = 0; i < count; i++)
+    {
+        for (j = 0; j < count; j++)
+        {
+            if (classifyCpus(&cpus[i], &cpus[j]) == placement)
+            {
+                *first = cpus[i].cpu;
+                *second = cpus[j].cpu;
+                return 0;
+            }
+        }
+    }
+
+    return -1;
+}
+
+#endif
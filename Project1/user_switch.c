@@ -0,0 +1,523 @@
+/* user_switch.c
+ *
+ * This program measures the time required for a user-level context switch,
+ * for comparison with the kernel switches measured by context_switch.c.
+ *
+ * A small coroutine engine switches either with swapcontext(), or with a
+ * hand-written x86-64 routine that saves only the callee-saved registers. The
+ * routine can optionally also save the floating point control state (MXCSR and
+ * the x87 control word) or the signal mask, which together are what
+ * swapcontext() preserves.
+ *
+ * Two benchmarks are run for every engine. The ping-pong benchmark follows
+ * the methodology of context_switch.c: the main coroutine timestamps just
+ * before switching, and the other coroutine replies with the time at which it
+ * started running. The yield chain passes control around a ring of many
+ * coroutines and reports the average cost of one switch. For reference, the
+ * ping-pong is also run between two kernel threads on the same CPU, woken
+ * through a futex.
+ *
+ * Usage: ./user_switch [-t <engine>] [-n <count>] [-c <coroutines>]
+ */
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "timer.h"
+
+#define WRITE_COUNT 1000
+#define NUM_COROUTINES 1000
+#define YIELD_ROUNDS 100
+#define STACK_SIZE (64 * 1024)
+
+/* Uncomment the line below to turn on logging */
+/*
+#define ENABLE_LOG
+*/
+
+/* Ways of switching between coroutines */
+typedef enum Engine
+{
+    UCONTEXT,
+    ASM,
+    ASM_FPU,
+    ASM_SIGMASK,
+    KERNEL_FUTEX,
+    NUM_ENGINES
+} Engine;
+
+const char *engineNames[NUM_ENGINES] =
+{
+    "ucontext", "asm", "asm+fpu", "asm+sigmask", "kernel-futex"
+};
+
+/* A coroutine with its own stack. The main coroutine runs on the stack of
+ * the thread and has none of its own.
+ */
+typedef struct Coroutine
+{
+    void *sp;
+    ucontext_t context;
+    sigset_t mask;
+    char *stack;
+    void (*entry)(struct Coroutine *);
+    struct Coroutine *next;
+} Coroutine;
+
+/* Engine used by the running benchmark */
+Engine engine;
+
+/* The main coroutine, and the time tick stored by the ping-pong partner */
+Coroutine mainCoroutine;
+volatile unsigned long long pongTime;
+
+#ifdef __x86_64__
+/* void switchContext(void **saveSp, void *loadSp)
+ *
+ * Push the callee-saved registers on the current stack, save the stack
+ * pointer, switch to the other stack and pop its registers. The caller-saved
+ * registers are already spilled by the compiler around the call.
+ */
+__asm__(
+    ".text\n"
+    ".globl switchContext\n"
+    ".type switchContext, @function\n"
+    "switchContext:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size switchContext, .-switchContext\n"
+);
+
+/* void switchContextFpu(void **saveSp, void *loadSp)
+ *
+ * Same as switchContext(), but also save MXCSR and the x87 control word,
+ * which the ABI requires to be preserved across calls.
+ */
+__asm__(
+    ".text\n"
+    ".globl switchContextFpu\n"
+    ".type switchContextFpu, @function\n"
+    "switchContextFpu:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size switchContextFpu, .-switchContextFpu\n"
+);
+
+/* First code run on a new stack: call entry(coroutine), held in r13 and r12.
+ * The entry function never returns.
+ */
+__asm__(
+    ".text\n"
+    ".type coroutineTrampoline, @function\n"
+    "coroutineTrampoline:\n"
+    "    movq %r12, %rdi\n"
+    "    callq *%r13\n"
+    "    ud2\n"
+    ".size coroutineTrampoline, .-coroutineTrampoline\n"
+);
+
+void switchContext(void **saveSp, void *loadSp);
+void switchContextFpu(void **saveSp, void *loadSp);
+void coroutineTrampoline(void);
+#endif
+
+/* Check whether an engine can run on this machine */
+int engineAvailable(Engine e)
+{
+#ifdef __x86_64__
+    return 1;
+#else
+    return e == UCONTEXT || e == KERNEL_FUTEX;
+#endif
+}
+
+/* Switch from the running coroutine to another one */
+static inline void transfer(Coroutine *from, Coroutine *to)
+{
+    switch (engine)
+    {
+#ifdef __x86_64__
+    case ASM:
+        switchContext(&from->sp, to->sp);
+        break;
+
+    case ASM_FPU:
+        switchContextFpu(&from->sp, to->sp);
+        break;
+
+    case ASM_SIGMASK:
+        pthread_sigmask(SIG_SETMASK, &to->mask, &from->mask);
+        switchContext(&from->sp, to->sp);
+        break;
+#endif
+
+    default:
+        swapcontext(&from->context, &to->context);
+        break;
+    }
+}
+
+/* Entry point of ucontext coroutines, which can only pass int arguments */
+void ucontextEntry(unsigned int high, unsigned int low)
+{
+    Coroutine *coroutine = (Coroutine *)
+        (((unsigned long) high << 16 << 16) | low);
+
+    coroutine->entry(coroutine);
+}
+
+/* Create a coroutine that runs entry(coroutine) when first switched to */
+void createCoroutine(Coroutine *coroutine, void (*entry)(Coroutine *))
+{
+    unsigned long address = (unsigned long) coroutine;
+    void **sp;
+
+    memset(coroutine, 0, sizeof(Coroutine));
+    coroutine->entry = entry;
+    coroutine->stack = mmap(NULL, STACK_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (coroutine->stack == MAP_FAILED)
+    {
+        perror("Memory map error");
+        exit(EXIT_FAILURE);
+    }
+    pthread_sigmask(SIG_SETMASK, NULL, &coroutine->mask);
+
+    if (engine == UCONTEXT)
+    {
+        getcontext(&coroutine->context);
+        coroutine->context.uc_stack.ss_sp = coroutine->stack;
+        coroutine->context.uc_stack.ss_size = STACK_SIZE;
+        coroutine->context.uc_link = NULL;
+        makecontext(&coroutine->context, (void (*)(void)) ucontextEntry, 2,
+            (unsigned int) (address >> 16 >> 16), (unsigned int) address);
+        return;
+    }
+
+#ifdef __x86_64__
+    /* Lay out the frame popped by the first switch: the return address of
+     * the trampoline at the 16-byte aligned top, then the saved registers
+     * with r12 and r13 holding the arguments of the trampoline
+     */
+    sp = (void **) (coroutine->stack + STACK_SIZE);
+    *--sp = (void *) coroutineTrampoline;
+    *--sp = NULL;                                   /* rbp */
+    *--sp = NULL;                                   /* rbx */
+    *--sp = coroutine;                              /* r12 */
+    *--sp = (void *) entry;                         /* r13 */
+    *--sp = NULL;                                   /* r14 */
+    *--sp = NULL;                                   /* r15 */
+    if (engine == ASM_FPU)
+    {
+        /* Default MXCSR in the low half, default x87 control word above */
+        *--sp = (void *) ((0x037fUL << 32) | 0x1f80UL);
+    }
+    coroutine->sp = sp;
+#endif
+}
+
+/* Release the stack of a coroutine */
+void destroyCoroutine(Coroutine *coroutine)
+{
+    munmap(coroutine->stack, STACK_SIZE);
+}
+
+/* Ping-pong partner: store the time it starts running, then switch back */
+void pongRoutine(Coroutine *self)
+{
+    while (1)
+    {
+        pongTime = timerEnd();
+        transfer(self, &mainCoroutine);
+    }
+}
+
+/* Yield chain member: pass control to the next coroutine of the ring */
+void yieldRoutine(Coroutine *self)
+{
+    while (1)
+    {
+        transfer(self, self->next);
+    }
+}
+
+/* Measure the average one-way latency of a coroutine switch in nanoseconds */
+double measurePingPong(int writeCount)
+{
+    Coroutine pong;
+    unsigned long long startTime, elapsedTime, totalTime = 0;
+    int i;
+
+    createCoroutine(&pong, pongRoutine);
+
+    for (i = 0; i <= writeCount; i++)
+    {
+        /* Get the time tick just before switching to the partner */
+        startTime = timerStart();
+        transfer(&mainCoroutine, &pong);
+
+        /* We skip the 0th iteration, which includes the first touch of the
+         * partner's stack
+         */
+        if (i == 0) continue;
+
+        elapsedTime = pongTime - startTime;
+
+#ifdef ENABLE_LOG
+        printf("\n%llu", elapsedTime);
+#endif
+
+        totalTime += elapsedTime;
+    }
+
+    destroyCoroutine(&pong);
+
+    return (double) totalTime / writeCount;
+}
+
+/* Measure the average cost of one switch around a ring of coroutines */
+double measureYieldChain(int numCoroutines)
+{
+    Coroutine *ring;
+    unsigned long long startTime, endTime;
+    int i;
+
+    if ((ring = malloc(sizeof(Coroutine) * numCoroutines)) == NULL)
+    {
+        perror("Allocation error");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Link every coroutine to the next one, and the last back to main */
+    for (i = 0; i < numCoroutines; i++)
+    {
+        createCoroutine(&ring[i], yieldRoutine);
+        ring[i].next = i + 1 < numCoroutines ? &ring[i + 1] : &mainCoroutine;
+    }
+
+    /* Warm up every stack once, then time the rounds */
+    transfer(&mainCoroutine, &ring[0]);
+    startTime = timerStart();
+    for (i = 0; i < YIELD_ROUNDS; i++)
+    {
+        transfer(&mainCoroutine, &ring[0]);
+    }
+    endTime = timerEnd();
+
+    for (i = 0; i < numCoroutines; i++)
+    {
+        destroyCoroutine(&ring[i]);
+    }
+    free(ring);
+
+    return (double) (endTime - startTime) /
+        ((double) YIELD_ROUNDS * (numCoroutines + 1));
+}
+
+/* Wrapper for the futex system call, which has no glibc stub */
+long futex(int *uaddr, int op, int val)
+{
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+/* Hand-off word and time tick shared by the two kernel threads */
+int turn;
+volatile unsigned long long threadTime;
+
+/* Wait until the hand-off word holds the given value */
+void waitTurn(int value)
+{
+    int current;
+
+    while ((current = __atomic_load_n(&turn, __ATOMIC_ACQUIRE)) != value)
+    {
+        futex(&turn, FUTEX_WAIT_PRIVATE, current);
+    }
+}
+
+/* Store a value in the hand-off word and wake the other thread */
+void passTurn(int value)
+{
+    __atomic_store_n(&turn, value, __ATOMIC_RELEASE);
+    futex(&turn, FUTEX_WAKE_PRIVATE, 1);
+}
+
+/* Kernel ping-pong partner: reply with the time it was woken */
+void *pongThread(void *arg)
+{
+    int writeCount = *(int *) arg, i;
+
+    for (i = 0; i <= writeCount; i++)
+    {
+        waitTurn(1);
+        threadTime = timerEnd();
+        passTurn(0);
+    }
+
+    return NULL;
+}
+
+/* Measure the average one-way latency of a kernel thread switch through a
+ * futex, with both threads on the CPU the caller is running on
+ */
+double measureKernelPingPong(int writeCount)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    cpu_set_t mask;
+    unsigned long long startTime, totalTime = 0;
+    int i;
+
+    CPU_ZERO(&mask);
+    CPU_SET(sched_getcpu(), &mask);
+    pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(mask), &mask);
+
+    turn = 0;
+    if ((errno = pthread_create(&thread, &attr, pongThread, &writeCount)) != 0)
+    {
+        perror("Thread creation error");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i <= writeCount; i++)
+    {
+        /* Get the time tick just before waking the partner */
+        startTime = timerStart();
+        passTurn(1);
+        waitTurn(0);
+
+        if (i == 0) continue;
+
+        totalTime += threadTime - startTime;
+    }
+
+    pthread_join(thread, NULL);
+    pthread_attr_destroy(&attr);
+
+    return (double) totalTime / writeCount;
+}
+
+int main(int argc, char *argv[])
+{
+    int writeCount = WRITE_COUNT, numCoroutines = NUM_COROUTINES, selected = -1;
+    int opt, e;
+
+    /* Parse the engine selection, the write count and the ring size */
+    while ((opt = getopt(argc, argv, "t:n:c:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            for (selected = 0; selected < NUM_ENGINES; selected++)
+            {
+                if (!strcmp(optarg, engineNames[selected])) break;
+            }
+            if (selected == NUM_ENGINES)
+            {
+                fprintf(stderr, "Unknown engine: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'n':
+            if ((writeCount = atoi(optarg)) <= 0)
+            {
+                fprintf(stderr, "Invalid write count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'c':
+            if ((numCoroutines = atoi(optarg)) <= 0)
+            {
+                fprintf(stderr, "Invalid coroutine count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-t <engine>] [-n <count>] "
+                "[-c <coroutines>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Calibrate the timer before taking any measurement */
+    initTimer();
+    printTimerInfo();
+    printf("\nTotal write count: %d", writeCount);
+    printf("\nCoroutines in the yield chain: %d", numCoroutines);
+    printf("\n%-13s %15s %20s", "Engine", "Ping-pong (ns)",
+        "Yield chain (ns/sw)");
+
+    for (e = 0; e < NUM_ENGINES; e++)
+    {
+        if (selected != -1 && e != selected) continue;
+
+        if (!engineAvailable(e))
+        {
+            printf("\n%-13s %15s %20s", engineNames[e], "n/a", "n/a");
+            continue;
+        }
+
+        engine = e;
+        if (engine == KERNEL_FUTEX)
+        {
+            printf("\n%-13s %15.1f %20s", engineNames[e],
+                measureKernelPingPong(writeCount), "n/a");
+        }
+        else
+        {
+            printf("\n%-13s %15.1f", engineNames[e], measurePingPong(writeCount));
+            printf(" %20.1f", measureYieldChain(numCoroutines));
+        }
+        fflush(stdout);
+    }
+    printf("\n");
+
+    return 0;
+}
@@ -0,0 +1,492 @@
+/* wakeup_latency.c
+ *
+ * This program measures the scheduler wakeup latency of periodic timer-driven
+ * threads, in the manner of cyclictest.
+ *
+ * Every measuring thread sleeps until an absolute deadline on CLOCK_MONOTONIC
+ * with clock_nanosleep(TIMER_ABSTIME), advances the deadline by the interval
+ * and records how late it actually woke up. The threads run under SCHED_OTHER,
+ * SCHED_FIFO or SCHED_DEADLINE; policies the process is not permitted to use
+ * are reported as such and skipped.
+ *
+ * Background load can be generated by worker processes that repeat the fork()
+ * and exit/wait loop of process.c, or the pthread_create() and join loop of
+ * thread.c, for the whole measurement. The latency distribution of each policy
+ * is reported as percentiles, and with -H also as a power of two histogram.
+ *
+ * Usage: ./wakeup_latency [-p <policy>] [-i <interval us>] [-n <loops>]
+ *                         [-T <threads>] [-r <priority>]
+ *                         [-l <load>] [-w <load workers>] [-H]
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "stats.h"
+
+#define NANOSECONDS 1000000000
+#define INTERVAL_US 1000
+#define NUM_LOOPS 10000
+#define FIFO_PRIORITY 80
+#define NUM_BUCKETS 32
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+/* Uncomment the line below to turn on logging */
+/*
+#define ENABLE_LOG
+*/
+
+/* Scheduling policies of the measuring threads */
+typedef enum Policy
+{
+    OTHER,
+    FIFO,
+    DEADLINE,
+    NUM_POLICIES
+} Policy;
+
+const char *policyNames[NUM_POLICIES] =
+{
+    "other", "fifo", "deadline"
+};
+
+/* Background load run by the worker processes */
+typedef enum Load
+{
+    NO_LOAD,
+    FORK_LOAD,
+    THREAD_LOAD,
+    NUM_LOADS
+} Load;
+
+const char *loadNames[NUM_LOADS] =
+{
+    "none", "fork", "thread"
+};
+
+/* Attributes for sched_setattr(), which has no glibc wrapper */
+typedef struct DeadlineAttr
+{
+    unsigned int size, policy;
+    unsigned long long flags;
+    int nice;
+    unsigned int priority;
+    unsigned long long runtime, deadline, period;
+} DeadlineAttr;
+
+/* State of one measuring thread */
+typedef struct Sampler
+{
+    pthread_t thread;
+    pthread_barrier_t *barrier;
+    Policy policy;
+    int priority, cpu, numLoops, count, failed;
+    long interval;
+    unsigned long long *latencies;
+} Sampler;
+
+/* Convert a timespec to nanoseconds */
+unsigned long long toNanoseconds(struct timespec *ts)
+{
+    return (unsigned long long) ts->tv_sec * NANOSECONDS + ts->tv_nsec;
+}
+
+/* Switch the calling thread to the given policy. Returns -1 on error. */
+int setPolicy(Policy policy, int priority, long interval)
+{
+    struct sched_param param;
+    DeadlineAttr attr;
+
+    switch (policy)
+    {
+    case FIFO:
+        param.sched_priority = priority;
+        errno = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        return errno ? -1 : 0;
+
+    case DEADLINE:
+        /* Reserve a tenth of every period, due by the end of the period */
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.policy = SCHED_DEADLINE;
+        attr.period = attr.deadline = interval;
+        attr.runtime = interval / 10;
+        return syscall(SYS_sched_setattr, 0, &attr, 0) == -1 ? -1 : 0;
+
+    default:
+        return 0;
+    }
+}
+
+/* Measuring thread: take on the policy, then sleep and wake periodically */
+void *sample_routine(void *arg)
+{
+    Sampler *sampler = (Sampler *) arg;
+    struct timespec next, now;
+    cpu_set_t mask;
+    int i;
+
+    /* Deadline threads must keep the full affinity mask of the root domain */
+    if (sampler->policy != DEADLINE)
+    {
+        CPU_ZERO(&mask);
+        CPU_SET(sampler->cpu, &mask);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) != 0)
+        {
+            fprintf(stderr, "Could not pin measuring thread to CPU %d\n",
+                sampler->cpu);
+        }
+    }
+
+    sampler->failed = setPolicy(sampler->policy, sampler->priority,
+        sampler->interval) == -1 ? errno : 0;
+
+    pthread_barrier_wait(sampler->barrier);
+    if (sampler->failed) return NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for (i = 0; i < sampler->numLoops; i++)
+    {
+        /* Advance the absolute deadline by one interval */
+        next.tv_nsec += sampler->interval;
+        while (next.tv_nsec >= NANOSECONDS)
+        {
+            next.tv_nsec -= NANOSECONDS;
+            next.tv_sec++;
+        }
+
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0)
+        {
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        sampler->latencies[sampler->count++] = toNanoseconds(&now) -
+            toNanoseconds(&next);
+    }
+
+    return NULL;
+}
+
+/* Thread created and joined over and over by the thread load */
+void *load_routine(void *arg)
+{
+    return NULL;
+}
+
+/* Body of a load worker process. Never returns. */
+void runLoad(Load load)
+{
+    pthread_t thread;
+    pid_t pid;
+
+    for (;;)
+    {
+        if (load == FORK_LOAD)
+        {
+            /* The fork loop of process.c */
+            if ((pid = fork()) == 0) _exit(EXIT_SUCCESS);
+            if (pid > 0) waitpid(pid, NULL, 0);
+        }
+        else
+        {
+            /* The thread creation loop of thread.c */
+            if (pthread_create(&thread, NULL, load_routine, NULL) == 0)
+            {
+                pthread_join(thread, NULL);
+            }
+        }
+    }
+}
+
+/* Start the given number of load worker processes. Returns their PIDs. */
+pid_t *startLoad(Load load, int numWorkers)
+{
+    pid_t *workers;
+    int i;
+
+    if ((workers = calloc(numWorkers, sizeof(pid_t))) == NULL)
+    {
+        perror("Allocation error");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < numWorkers; i++)
+    {
+        switch (workers[i] = fork())
+        {
+        case -1:
+            perror("Fork error");
+            exit(EXIT_FAILURE);
+
+        case 0:
+            runLoad(load);
+        }
+    }
+
+    return workers;
+}
+
+/* Kill and reap the load worker processes */
+void stopLoad(pid_t *workers, int numWorkers)
+{
+    int i;
+
+    for (i = 0; i < numWorkers; i++)
+    {
+        kill(workers[i], SIGKILL);
+    }
+    for (i = 0; i < numWorkers; i++)
+    {
+        waitpid(workers[i], NULL, 0);
+    }
+    free(workers);
+}
+
+/* Print the non-empty power of two buckets of the sorted latencies */
+void printHistogram(const unsigned long long *sorted, int count)
+{
+    int buckets[NUM_BUCKETS] = { 0 }, bucket, i;
+
+    for (i = 0; i < count; i++)
+    {
+        bucket = sorted[i] ? 64 - __builtin_clzll(sorted[i]) : 0;
+        if (bucket >= NUM_BUCKETS) bucket = NUM_BUCKETS - 1;
+        buckets[bucket]++;
+    }
+
+    for (i = 0; i < NUM_BUCKETS; i++)
+    {
+        if (buckets[i] == 0) continue;
+        printf("\n  < %12llu ns %10d %7.3f%%", 1ULL << i, buckets[i],
+            100.0 * buckets[i] / count);
+    }
+}
+
+/* Run the measuring threads under the policy and print the distribution */
+void measurePolicy(Policy policy, int numThreads, int numLoops, long interval,
+    int priority, int histogram)
+{
+    Sampler *samplers;
+    pthread_barrier_t barrier;
+    cpu_set_t mask;
+    unsigned long long *samples, sum = 0;
+    int cpus[CPU_SETSIZE], numCpus = 0, count = 0, failed = 0, retVal, cpu;
+    int i, j;
+
+    /* Spread the measuring threads over the CPUs of the affinity mask */
+    if (sched_getaffinity(0, sizeof(mask), &mask) == -1)
+    {
+        perror("Affinity Mask error");
+        exit(EXIT_FAILURE);
+    }
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &mask)) cpus[numCpus++] = cpu;
+    }
+
+    samplers = calloc(numThreads, sizeof(Sampler));
+    samples = malloc(sizeof(unsigned long long) * numThreads * numLoops);
+    if (samplers == NULL || samples == NULL)
+    {
+        perror("Allocation error");
+        exit(EXIT_FAILURE);
+    }
+    pthread_barrier_init(&barrier, NULL, numThreads);
+
+    for (i = 0; i < numThreads; i++)
+    {
+        samplers[i].barrier = &barrier;
+        samplers[i].policy = policy;
+        samplers[i].priority = priority;
+        samplers[i].cpu = cpus[i % numCpus];
+        samplers[i].numLoops = numLoops;
+        samplers[i].interval = interval;
+        samplers[i].latencies = samples + (size_t) i * numLoops;
+        if ((retVal = pthread_create(&samplers[i].thread, NULL,
+            sample_routine, &samplers[i])) != 0)
+        {
+            errno = retVal;
+            perror("Thread creation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < numThreads; i++)
+    {
+        pthread_join(samplers[i].thread, NULL);
+        if (samplers[i].failed) failed = samplers[i].failed;
+    }
+
+    if (failed)
+    {
+        printf("\n%-9s %7d %s", policyNames[policy], numThreads,
+            failed == EPERM ? "not permitted" : strerror(failed));
+    }
+    else
+    {
+        /* Gather the samples of all threads into one sorted array */
+        for (i = 0; i < numThreads; i++)
+        {
+            for (j = 0; j < samplers[i].count; j++)
+            {
+                samples[count] = samplers[i].latencies[j];
+                sum += samples[count++];
+            }
+        }
+        sortSamples(samples, count);
+
+#ifdef ENABLE_LOG
+        fprintf(stderr, "\n[%s] %d samples", policyNames[policy], count);
+#endif
+
+        printf("\n%-9s %7d %9d %10llu %10.1f %10llu %10llu %10llu %10llu",
+            policyNames[policy], numThreads, count,
+            count ? samples[0] : 0, count ? (double) sum / count : 0,
+            percentile(samples, count, 50), percentile(samples, count, 99),
+            percentile(samples, count, 99.9),
+            count ? samples[count - 1] : 0);
+        if (histogram) printHistogram(samples, count);
+    }
+    fflush(stdout);
+
+    pthread_barrier_destroy(&barrier);
+    free(samples);
+    free(samplers);
+}
+
+int main(int argc, char *argv[])
+{
+    pid_t *workers = NULL;
+    long interval = INTERVAL_US * 1000L;
+    int numLoops = NUM_LOOPS, numThreads = 1, priority = FIFO_PRIORITY;
+    int numWorkers = -1, histogram = 0, policy = -1, load = NO_LOAD, opt, p;
+
+    /* Parse the policy, the timing and the background load */
+    while ((opt = getopt(argc, argv, "p:i:n:T:r:l:w:H")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            for (policy = 0; policy < NUM_POLICIES; policy++)
+            {
+                if (!strcmp(optarg, policyNames[policy])) break;
+            }
+            if (policy == NUM_POLICIES)
+            {
+                fprintf(stderr, "Unknown policy: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'i':
+            if ((interval = atol(optarg) * 1000L) <= 0)
+            {
+                fprintf(stderr, "Invalid interval: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'n':
+            if ((numLoops = atoi(optarg)) <= 0)
+            {
+                fprintf(stderr, "Invalid loop count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'T':
+            if ((numThreads = atoi(optarg)) <= 0)
+            {
+                fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'r':
+            if ((priority = atoi(optarg)) < sched_get_priority_min(SCHED_FIFO)
+                || priority > sched_get_priority_max(SCHED_FIFO))
+            {
+                fprintf(stderr, "Invalid priority: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'l':
+            for (load = 0; load < NUM_LOADS; load++)
+            {
+                if (!strcmp(optarg, loadNames[load])) break;
+            }
+            if (load == NUM_LOADS)
+            {
+                fprintf(stderr, "Unknown load: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'w':
+            if ((numWorkers = atoi(optarg)) < 0)
+            {
+                fprintf(stderr, "Invalid worker count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'H':
+            histogram = 1;
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-p <policy>] [-i <interval us>] "
+                "[-n <loops>] [-T <threads>] [-r <priority>] [-l <load>] "
+                "[-w <load workers>] [-H]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Run one load worker per online CPU unless told otherwise */
+    if (numWorkers == -1) numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (load == NO_LOAD) numWorkers = 0;
+
+    /* Keep page faults out of the wakeup path, as far as permitted */
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+    {
+        perror("Memory lock error");
+    }
+
+    printf("Interval: %ld us, loops per thread: %d", interval / 1000,
+        numLoops);
+    printf("\nLoad: %s (%d workers)", loadNames[load], numWorkers);
+    printf("\n%-9s %7s %9s %10s %10s %10s %10s %10s %10s", "Policy",
+        "Threads", "Samples", "min (ns)", "avg (ns)", "p50 (ns)", "p99 (ns)",
+        "p99.9 (ns)", "max (ns)");
+    fflush(stdout);
+
+    if (numWorkers) workers = startLoad(load, numWorkers);
+
+    for (p = 0; p < NUM_POLICIES; p++)
+    {
+        if (policy != -1 && p != policy) continue;
+
+        measurePolicy(p, numThreads, numLoops, interval, priority, histogram);
+    }
+
+    if (numWorkers) stopLoad(workers, numWorkers);
+    printf("\n");
+
+    return 0;
+}
@@ -0,0 +1,459 @@
+/*  beach.h
+ *
+ *  Lock-free admission of surfers into the water.
+ *
+ *  Surfers go in and out in groups of GROUP_SIZE (k), 2 by default, so that
+ *  no surfer is ever in the water with fewer than k - 1 others. The number
+ *  of surfers ready to surf (R), in the water (W) and ready to leave (L) are
+ *  packed into one 64-bit word and changed together with a single
+ *  compare-and-swap, so that W only ever moves between 0 and values of at
+ *  least k.
+ *
+ *      arrive   W > 0               join the surfers in the water    W += 1
+ *               W == 0, R >= k-1    go in with the waiting surfers   R -= k-1, W += k
+ *               otherwise           wait for the group to fill       R += 1
+ *      finish   W > k               leave alone                      W -= 1
+ *               W == k, L >= k-1    leave with the waiting surfers   W -= k, L -= k-1
+ *               otherwise           wait for the group to fill       L += 1
+ *
+ *  The surfer that completes a group hands the k - 1 waiting ones a token
+ *  each on a separate counter and wakes them all with a single futex call,
+ *  so the waiting surfers never touch the state word again. A surfer that
+ *  joins the water while some are waiting to leave lets one go out alone in
+ *  the same way. Waiting surfers sleep on an eventcount futex word, and are
+ *  only woken if someone is actually waiting.
+ *
+ *  The transitions are kept apart from the waiting, so that other kinds of
+ *  waiters, such as parked tasks, can use the same state word.
+ *
+ *  At dusk the beach is closed: a flag checked at every wait is raised and
+ *  both eventcounts are posted to all waiters, so every waiting surfer wakes
+ *  at once, whatever their number.
+ *
+ *  Several beaches can be used side by side, each surfer having a home
+ *  beach. A surfer who would have to wait at home goes in at the first
+ *  other beach where it would not. A waiting surfer looks every
+ *  STEAL_INTERVAL for surfers waiting at a beach with a lower index, and if
+ *  there are any takes back its arrival and moves to the lowest such beach,
+ *  so that waiting surfers gather at one beach instead of waiting at several
+ *  for long.
+ *
+ *  With BENCH every beach also keeps a census for the invariant checker: the
+ *  surfers let into the water who have not called surf() yet, and those let
+ *  out who have not called leave() yet. Every transition of W updates it in
+ *  the same write section, which the checker can tell is open, so a snapshot
+ *  taken while no section was open sees the state word, the census and the
+ *  states of the surfers as they were at one instant. When sections keep
+ *  being open, the checker pauses the census: new sections wait until the
+ *  snapshot is taken, and the open ones are waited for.
+ */
+
+#ifndef BEACH_H
+#define BEACH_H
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Layout of the packed state word */
+#define FIELD_BITS 21
+#define FIELD_MASK ((1ULL << FIELD_BITS) - 1)
+#define READY_SHIFT 0
+#define WATER_SHIFT FIELD_BITS
+#define LEAVE_SHIFT (2 * FIELD_BITS)
+
+#define FIELD(state, shift) ((int) (((state) >> (shift)) & FIELD_MASK))
+#define ONE(shift) (1ULL << (shift))
+
+/* Number of surfers that go in and out together */
+#ifndef GROUP_SIZE
+#define GROUP_SIZE 2
+#endif
+
+/* Time between two looks at the other beaches while waiting, in nanoseconds */
+#define STEAL_INTERVAL 200000
+
+/* Wrapper for the futex system call, which has no glibc stub */
+long futex(int *uaddr, int op, int val) {
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+/* A sequence number that waiters sleep on, and the number of them asleep */
+typedef struct event {
+    int sequence;
+    int waiters;
+} eventT;
+
+/*  Surfers owed a change of state by the transitions of a beach, the write
+ *  sections open on it, and whether new ones must wait. A section bumps the
+ *  generation as it closes.
+ */
+typedef struct census {
+    int writers, generation, paused;
+    int toSurf, toLeave;
+} censusT;
+
+/*  Shared state of one beach. The state word and the two sides of the
+ *  protocol live on their own cache lines.
+ */
+typedef struct beach {
+    unsigned long long state __attribute__((aligned(64)));
+    int dusk;
+    int enterTokens __attribute__((aligned(64)));
+    eventT enterEvent;
+    int leaveTokens __attribute__((aligned(64)));
+    eventT leaveEvent;
+#ifdef BENCH
+    censusT census __attribute__((aligned(64)));
+#endif
+} beachT;
+
+/* Open a write section on a census, once it is not paused */
+void beginCensus(censusT *c) {
+    for (;;)
+    {
+        __atomic_add_fetch(&c->writers, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&c->paused, __ATOMIC_SEQ_CST)) return;
+
+        __atomic_sub_fetch(&c->writers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&c->paused, __ATOMIC_SEQ_CST)) sched_yield();
+    }
+}
+
+/*  CENSUS_BEGIN and CENSUS_END open and close a write section on the census
+ *  of a beach, and CENSUS_ADD changes one of its counts within the section
+ */
+#ifdef BENCH
+#define CENSUS_BEGIN(b) beginCensus(&(b)->census)
+#define CENSUS_END(b) (__atomic_add_fetch(&(b)->census.generation, 1, __ATOMIC_SEQ_CST), \
+                       __atomic_sub_fetch(&(b)->census.writers, 1, __ATOMIC_SEQ_CST))
+#define CENSUS_ADD(b, count, n) __atomic_add_fetch(&(b)->census.count, (n), __ATOMIC_SEQ_CST)
+#else
+#define CENSUS_BEGIN(b)
+#define CENSUS_END(b)
+#define CENSUS_ADD(b, count, n)
+#endif
+
+/* Read the sequence number before checking the condition to wait for */
+int readEvent(eventT *e) {
+    return __atomic_load_n(&e->sequence, __ATOMIC_SEQ_CST);
+}
+
+/* Sleep until the sequence number moves on from the one read, or for at most timeout if given */
+void awaitEventFor(eventT *e, int seen, const struct timespec *timeout) {
+    __atomic_add_fetch(&e->waiters, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &e->sequence, FUTEX_WAIT_PRIVATE, seen, timeout, NULL, 0);
+    __atomic_sub_fetch(&e->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Sleep until the sequence number moves on from the one read */
+void awaitEvent(eventT *e, int seen) {
+    awaitEventFor(e, seen, NULL);
+}
+
+/* Move the sequence number on and wake up to count waiters, if any */
+void postEvent(eventT *e, int count) {
+    __atomic_add_fetch(&e->sequence, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&e->waiters, __ATOMIC_SEQ_CST) > 0)
+    {
+        futex(&e->sequence, FUTEX_WAKE_PRIVATE, count);
+    }
+}
+
+/* Take one token if there is any. Returns 1 if a token was taken. */
+int takeToken(int *tokens) {
+    int available = __atomic_load_n(tokens, __ATOMIC_ACQUIRE);
+
+    while (available > 0)
+    {
+        if (__atomic_compare_exchange_n(tokens, &available, available - 1, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Outcomes of a transition of the state word */
+#define ALONE 0
+#define GROUPED 1
+#define WAIT 2
+
+/*  Arrive ready to surf. Returns ALONE if the surfer joined the surfers in
+ *  the water, GROUPED if it went in with the waiting surfers, who must then
+ *  be released, or WAIT if it must wait for the group to fill. If mayWait is 0, a
+ *  surfer who would have to wait does not arrive at all. The state before
+ *  the transition is stored in before.
+ */
+int arriveAtBeach(beachT *b, unsigned long long *before, int mayWait) {
+    unsigned long long state, next;
+    int outcome;
+
+    CENSUS_BEGIN(b);
+    state = __atomic_load_n(&b->state, __ATOMIC_RELAXED);
+    do
+    {
+        if (FIELD(state, WATER_SHIFT) > 0)
+        {
+            next = state + ONE(WATER_SHIFT);
+        }
+        else if (FIELD(state, READY_SHIFT) >= GROUP_SIZE - 1)
+        {
+            next = state - (GROUP_SIZE - 1) * ONE(READY_SHIFT) +
+                GROUP_SIZE * ONE(WATER_SHIFT);
+        }
+        else if (mayWait)
+        {
+            next = state + ONE(READY_SHIFT);
+        }
+        else
+        {
+            CENSUS_END(b);
+            return WAIT;
+        }
+    } while (!__atomic_compare_exchange_n(&b->state, &state, next, 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    *before = state;
+    if (FIELD(state, WATER_SHIFT) > 0)
+    {
+        outcome = ALONE;
+        CENSUS_ADD(b, toSurf, 1);
+    }
+    else if (FIELD(state, READY_SHIFT) >= GROUP_SIZE - 1)
+    {
+        outcome = GROUPED;
+        CENSUS_ADD(b, toSurf, GROUP_SIZE);
+    }
+    else
+    {
+        outcome = WAIT;
+    }
+    CENSUS_END(b);
+
+    return outcome;
+}
+
+/*  Finish surfing. Returns ALONE if the surfer left without leaving fewer
+ *  than k in the water, GROUPED if it left with the waiting surfers, who
+ *  must then be released, or WAIT if it must wait for the group to fill.
+ */
+int finishSurfing(beachT *b) {
+    unsigned long long state, next;
+    int outcome;
+
+    CENSUS_BEGIN(b);
+    state = __atomic_load_n(&b->state, __ATOMIC_RELAXED);
+    do
+    {
+        if (FIELD(state, WATER_SHIFT) > GROUP_SIZE)
+        {
+            next = state - ONE(WATER_SHIFT);
+        }
+        else if (FIELD(state, LEAVE_SHIFT) >= GROUP_SIZE - 1)
+        {
+            next = state - GROUP_SIZE * ONE(WATER_SHIFT) -
+                (GROUP_SIZE - 1) * ONE(LEAVE_SHIFT);
+        }
+        else
+        {
+            next = state + ONE(LEAVE_SHIFT);
+        }
+    } while (!__atomic_compare_exchange_n(&b->state, &state, next, 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    if (FIELD(state, WATER_SHIFT) > GROUP_SIZE)
+    {
+        outcome = ALONE;
+        CENSUS_ADD(b, toLeave, 1);
+    }
+    else if (FIELD(state, LEAVE_SHIFT) >= GROUP_SIZE - 1)
+    {
+        outcome = GROUPED;
+        CENSUS_ADD(b, toLeave, GROUP_SIZE);
+    }
+    else
+    {
+        outcome = WAIT;
+    }
+    CENSUS_END(b);
+
+    return outcome;
+}
+
+/*  Let a surfer waiting to leave go out alone, now that a surfer who just
+ *  joined keeps the others company. Returns 1 if a waiting surfer must be
+ *  released.
+ */
+int releaseLeaver(beachT *b) {
+    unsigned long long state;
+
+    CENSUS_BEGIN(b);
+    state = __atomic_load_n(&b->state, __ATOMIC_RELAXED);
+    while (FIELD(state, WATER_SHIFT) > GROUP_SIZE && FIELD(state, LEAVE_SHIFT) > 0)
+    {
+        if (__atomic_compare_exchange_n(&b->state, &state,
+            state - ONE(WATER_SHIFT) - ONE(LEAVE_SHIFT), 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            CENSUS_ADD(b, toLeave, 1);
+            CENSUS_END(b);
+            return 1;
+        }
+    }
+    CENSUS_END(b);
+
+    return 0;
+}
+
+/*  Take back the arrival of the surfer waiting at the beach, if no one has
+ *  gone in with it yet. Returns 1 if taken back.
+ */
+int leaveBeach(beachT *b) {
+    unsigned long long state = __atomic_load_n(&b->state, __ATOMIC_RELAXED);
+
+    while (FIELD(state, READY_SHIFT) > 0)
+    {
+        if (__atomic_compare_exchange_n(&b->state, &state,
+            state - ONE(READY_SHIFT), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Hand a token to count waiting surfers and wake them together */
+void releaseWaiters(int *tokens, eventT *e, int count) {
+    __atomic_add_fetch(tokens, count, __ATOMIC_RELEASE);
+    postEvent(e, count);
+}
+
+/* Check whether the beach has been closed for the day */
+int beachClosed(beachT *b) {
+    return __atomic_load_n(&b->dusk, __ATOMIC_SEQ_CST);
+}
+
+/* Close the beach and wake every waiting surfer */
+void closeBeach(beachT *b) {
+    __atomic_store_n(&b->dusk, 1, __ATOMIC_SEQ_CST);
+    postEvent(&b->enterEvent, INT_MAX);
+    postEvent(&b->leaveEvent, INT_MAX);
+}
+
+/* Sleep until a token for this surfer arrives. Returns 0 if woken at dusk instead. */
+int awaitToken(beachT *b, int *tokens, eventT *e) {
+    int seen;
+
+    for (;;)
+    {
+        seen = readEvent(e);
+        if (takeToken(tokens)) return 1;
+        if (beachClosed(b)) return 0;
+        awaitEvent(e, seen);
+    }
+}
+
+/* Release whoever a surfer who went in without waiting went in with, or let out */
+void admitSurfer(beachT *b, int outcome, unsigned long long before) {
+    if (outcome == GROUPED)
+    {
+        releaseWaiters(&b->enterTokens, &b->enterEvent, GROUP_SIZE - 1);
+    }
+    else if (FIELD(before, LEAVE_SHIFT) > 0 && releaseLeaver(b))
+    {
+        /* A surfer waiting to leave may now leave alone */
+        releaseWaiters(&b->leaveTokens, &b->leaveEvent, 1);
+    }
+}
+
+/* Get the lowest beach below the given one where surfers are waiting, or -1 if there is none */
+int waiterBelow(beachT *beaches, int at) {
+    int i;
+
+    for (i = 0; i < at; i++)
+    {
+        if (FIELD(__atomic_load_n(&beaches[i].state, __ATOMIC_RELAXED), READY_SHIFT) > 0) return i;
+    }
+
+    return -1;
+}
+
+/*  Get a ready surfer into the water at one of count beaches, preferring its
+ *  home beach and waiting there for the group to fill if needed. Returns the
+ *  beach entered, or NULL if the beach closed while waiting.
+ */
+beachT *enterAnyWater(beachT *beaches, int count, int home) {
+    struct timespec interval = { 0, STEAL_INTERVAL };
+    unsigned long long state;
+    beachT *b;
+    int outcome, seen, at, i;
+
+    /* Go in at the first beach, from home on, where no waiting is needed */
+    for (i = 0; i < count; i++)
+    {
+        b = &beaches[(home + i) % count];
+        if ((outcome = arriveAtBeach(b, &state, 0)) != WAIT)
+        {
+            admitSurfer(b, outcome, state);
+            return b;
+        }
+    }
+
+    /* Wait at home, or with the surfers waiting further down once seen */
+    for (at = home; ; )
+    {
+        b = &beaches[at];
+        if ((outcome = arriveAtBeach(b, &state, 1)) != WAIT)
+        {
+            admitSurfer(b, outcome, state);
+            return b;
+        }
+
+        for (;;)
+        {
+            seen = readEvent(&b->enterEvent);
+            if (takeToken(&b->enterTokens)) return b;
+            if (beachClosed(b)) return NULL;
+
+            if (count > 1 && (i = waiterBelow(beaches, at)) >= 0 && leaveBeach(b))
+            {
+                at = i;
+                break;
+            }
+            awaitEventFor(&b->enterEvent, seen, count > 1 ? &interval : NULL);
+        }
+    }
+}
+
+/*  Get a ready surfer into the water, waiting for the group to fill if needed.
+ *  Returns 0 if the beach closed while waiting.
+ */
+int enterWater(beachT *b) {
+    return enterAnyWater(b, 1, 0) != NULL;
+}
+
+/*  Get a surfer out of the water, waiting if it would leave fewer than k.
+ *  Returns 0 if the beach closed while waiting.
+ */
+int leaveWater(beachT *b) {
+    switch (finishSurfing(b))
+    {
+    case GROUPED:
+        releaseWaiters(&b->leaveTokens, &b->leaveEvent, GROUP_SIZE - 1);
+        break;
+
+    case WAIT:
+        return awaitToken(b, &b->leaveTokens, &b->leaveEvent);
+    }
+
+    return 1;
+}
+
+#endif
@@ -0,0 +1,295 @@
+/*  eventlog.h
+ *
+ *  Asynchronous log of surfer events.
+ *
+ *  Every thread that logs gets its own single-producer single-consumer ring
+ *  of events on first use, so logging takes no lock and makes no system
+ *  call. A background writer thread drains all rings in batches, formats
+ *  the events with their timestamps and writes each batch to stdout at once.
+ *  The writer sleeps on an eventcount between batches, and a thread whose
+ *  ring gets half full wakes it. A thread whose ring is full sleeps on
+ *  another eventcount until the next batch has been written, so no event is
+ *  ever dropped.
+ *
+ *  The rings are merged on the timestamps within each batch. An event logged
+ *  just before a batch but published just after it may still come out in
+ *  the next batch, slightly out of order; sort the output on the timestamp
+ *  to get the exact order.
+ */
+
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "beach.h"
+
+/* Number of events in the ring of each thread, a power of 2 */
+#define LOG_RING_SIZE 512
+
+/* Longest time the writer sleeps between batches, in nanoseconds */
+#define LOG_INTERVAL 1000000
+
+/* Size of the output buffer of the writer */
+#define LOG_BUFFER_SIZE 65536
+
+typedef struct logEvent {
+    unsigned long long time;
+    int id;
+    int state;
+} logEventT;
+
+/* Ring of one thread, with the ends written by each side on their own cache lines */
+typedef struct logRing {
+    unsigned int head __attribute__((aligned(64)));
+    unsigned int tail __attribute__((aligned(64)));
+    struct logRing *next;
+    logEventT events[LOG_RING_SIZE];
+} logRingT;
+
+typedef struct eventLog {
+    logRingT *rings;
+    struct timespec start;
+    pthread_t writer;
+    int stopping;
+    eventT wake;
+    eventT space;
+} eventLogT;
+
+eventLogT _log;
+
+/* The ring of the thread running */
+__thread logRingT *_logRing;
+
+/* Get the nanoseconds since the log was started */
+unsigned long long logTime() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - _log.start.tv_sec) * 1000000000ULL +
+        now.tv_nsec - _log.start.tv_nsec;
+}
+
+/* Give the calling thread a ring and add it to the ones the writer drains */
+logRingT *addLogRing() {
+    logRingT *r = calloc(1, sizeof(logRingT));
+
+    if (r == NULL)
+    {
+        perror("Allocation error");
+        exit(EXIT_FAILURE);
+    }
+
+    r->next = __atomic_load_n(&_log.rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&_log.rings, &r->next, r, 0,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return _logRing = r;
+}
+
+/* Log that a surfer moved to a state */
+void logEvent(int id, int state) {
+    logRingT *r = _logRing != NULL ? _logRing : addLogRing();
+    unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    logEventT *e;
+    int seen;
+
+    /* Wait for the writer if the ring is full */
+    for (;;)
+    {
+        seen = readEvent(&_log.space);
+        if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) < LOG_RING_SIZE) break;
+        postEvent(&_log.wake, 1);
+        awaitEvent(&_log.space, seen);
+    }
+
+    e = &r->events[tail & (LOG_RING_SIZE - 1)];
+    e->time = logTime();
+    e->id = id;
+    e->state = state;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+    /* Have the writer drain the ring well before it fills up */
+    if (tail + 1 - __atomic_load_n(&r->head, __ATOMIC_RELAXED) == LOG_RING_SIZE / 2)
+    {
+        postEvent(&_log.wake, 1);
+    }
+}
+
+/* Write an unsigned number in decimal, padded with zeros to width digits. Returns the end. */
+char *formatNumber(char *out, unsigned long long value, int width) {
+    char digits[24];
+    int n = 0;
+
+    do
+    {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0 || n < width);
+
+    while (n > 0) *out++ = digits[--n];
+    return out;
+}
+
+/* Format one event as a line of the log. Returns the end. */
+char *formatEvent(char *out, logEventT *e) {
+    static const char *actions[] = { " arrives", " is surfing", " leaves" };
+    const char *action = actions[e->state];
+
+    *out++ = '\n';
+    out = formatNumber(out, e->time / 1000000000, 1);
+    *out++ = '.';
+    out = formatNumber(out, e->time / 1000 % 1000000, 6);
+    *out++ = ' ';
+    *out++ = 's';
+    out = formatNumber(out, e->id, 1);
+    while (*action != '\0') *out++ = *action++;
+
+    return out;
+}
+
+/* Events of one ring up to where it was filled when the batch started */
+typedef struct cursor {
+    logRingT *ring;
+    unsigned int head, tail;
+} cursorT;
+
+/* Time of the next event of a cursor */
+unsigned long long cursorTime(cursorT *c) {
+    return c->ring->events[c->head & (LOG_RING_SIZE - 1)].time;
+}
+
+/* Move the cursor at position i down the min-heap of n cursors to its place */
+void siftDown(cursorT *heap, int n, int i) {
+    cursorT c = heap[i];
+    int child;
+
+    while ((child = 2 * i + 1) < n)
+    {
+        if (child + 1 < n && cursorTime(&heap[child + 1]) < cursorTime(&heap[child])) child++;
+        if (cursorTime(&c) <= cursorTime(&heap[child])) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = c;
+}
+
+/*  Drain every ring into stdout as one batch, merging the rings in timestamp
+ *  order. The heap of cursors grows with the number of rings. Returns the
+ *  number of events written.
+ */
+int drainLog(char *buffer, cursorT **heap, int *capacity) {
+    logRingT *r;
+    char *end = buffer;
+    int n = 0, count = 0, i;
+
+    for (r = __atomic_load_n(&_log.rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+    {
+        if (n == *capacity)
+        {
+            *capacity = *capacity ? 2 * *capacity : 64;
+            if ((*heap = realloc(*heap, *capacity * sizeof(cursorT))) == NULL)
+            {
+                perror("Allocation error");
+                exit(EXIT_FAILURE);
+            }
+        }
+        (*heap)[n].ring = r;
+        (*heap)[n].head = r->head;
+        (*heap)[n].tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if ((*heap)[n].head != (*heap)[n].tail) n++;
+    }
+    for (i = n / 2 - 1; i >= 0; i--) siftDown(*heap, n, i);
+
+    while (n > 0)
+    {
+        cursorT *c = &(*heap)[0];
+
+        /* An event takes well under 64 characters */
+        if (end - buffer > LOG_BUFFER_SIZE - 64)
+        {
+            fwrite(buffer, 1, end - buffer, stdout);
+            end = buffer;
+        }
+        end = formatEvent(end, &c->ring->events[c->head & (LOG_RING_SIZE - 1)]);
+        count++;
+
+        /* Hand a drained ring back to its thread and drop it from the heap */
+        if (++c->head == c->tail)
+        {
+            __atomic_store_n(&c->ring->head, c->head, __ATOMIC_RELEASE);
+            (*heap)[0] = (*heap)[--n];
+        }
+        siftDown(*heap, n, 0);
+    }
+
+    fwrite(buffer, 1, end - buffer, stdout);
+    return count;
+}
+
+/* Drain the rings in batches until the log is stopped, then once more */
+void logWriter(void *x) {
+    struct timespec interval = { 0, LOG_INTERVAL };
+    char *buffer = malloc(LOG_BUFFER_SIZE);
+    cursorT *heap = NULL;
+    int capacity = 0, seen;
+
+    if (buffer == NULL)
+    {
+        perror("Allocation error");
+        exit(EXIT_FAILURE);
+    }
+
+    while (!__atomic_load_n(&_log.stopping, __ATOMIC_ACQUIRE))
+    {
+        seen = readEvent(&_log.wake);
+        if (drainLog(buffer, &heap, &capacity) > 0)
+        {
+            postEvent(&_log.space, INT_MAX);
+        }
+        else
+        {
+            awaitEventFor(&_log.wake, seen, &interval);
+        }
+    }
+    while (drainLog(buffer, &heap, &capacity) > 0);
+
+    fflush(stdout);
+    free(heap);
+    free(buffer);
+}
+
+/* Start the clock of the log and its writer thread */
+void startLog() {
+    int rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &_log.start);
+    rc = pthread_create(&_log.writer, NULL, (void *) &logWriter, NULL);
+    if (rc != 0)
+    {
+        errno = rc;
+        perror("pthread_create error");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Write out every event logged so far and free the rings, once all threads logging are done */
+void stopLog() {
+    logRingT *r, *next;
+
+    __atomic_store_n(&_log.stopping, 1, __ATOMIC_RELEASE);
+    postEvent(&_log.wake, 1);
+    pthread_join(_log.writer, NULL);
+
+    for (r = _log.rings; r != NULL; r = next)
+    {
+        next = r->next;
+        free(r);
+    }
+    _log.rings = NULL;
+}
+
+#endif
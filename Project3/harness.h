@@ -0,0 +1,225 @@
+/*  harness.h
+ *
+ *  Measurements for the surfers benchmark.
+ *
+ *  Latencies are recorded into log-linear histograms owned by the thread
+ *  recording them, so recording takes no lock, and the histograms of all
+ *  threads are merged once at the end. Every power of 2 is split into
+ *  2^SUB_BUCKET_BITS buckets, which bounds the error of a percentile to
+ *  about 12%.
+ *
+ *  The checker is a thread that takes a consistent snapshot of the states of
+ *  the surfers every CHECK_INTERVAL, and counts the snapshots that find fewer
+ *  than a group of surfers surfing at a beach, or the surfers surfing out of
+ *  step with the number the beach counts in the water. A snapshot that keeps
+ *  being torn by the surfers after SNAPSHOT_ATTEMPTS tries is taken with the
+ *  surfers paused instead, and counted as such. The checker waits at least
+ *  SNAPSHOT_SHARE times as long as its last snapshot took before the next
+ *  one, so that scanning many surfers does not take more than its share of
+ *  the CPU.
+ */
+
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SUB_BUCKET_BITS 3
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define BUCKETS (64 * SUB_BUCKETS)
+
+/* Time between two snapshots of the checker, in nanoseconds */
+#ifndef CHECK_INTERVAL
+#define CHECK_INTERVAL 100000
+#endif
+
+/* Tries at a snapshot before the surfers are paused for it, and the time between snapshots as a multiple of the time one takes */
+#define SNAPSHOT_ATTEMPTS 100
+#define SNAPSHOT_SHARE 9
+
+/* What a snapshot found, with SNAPSHOT_PAUSED added if the surfers had to be paused for it */
+#define SNAPSHOT_OK 0
+#define SNAPSHOT_ALONE 1
+#define SNAPSHOT_MISCOUNTED 2
+#define SNAPSHOT_PAUSED 4
+
+typedef struct histogram {
+    unsigned long long counts[BUCKETS];
+    unsigned long long total, max;
+} histogramT;
+
+/* Latencies recorded by one thread */
+typedef struct latencies {
+    histogramT enter, leave;
+    struct latencies *next;
+} latenciesT;
+
+typedef struct checker {
+    pthread_t thread;
+    int (*takeSnapshot)();
+    int stopping;
+    unsigned long long snapshots, alone, miscounted, paused;
+} checkerT;
+
+latenciesT *_allLatencies;
+
+/* The latencies of the thread running */
+__thread latenciesT *_latencies;
+
+/* Get the time in nanoseconds */
+unsigned long long nowNs() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Get the bucket of a value: values below SUB_BUCKETS have their own, the others share one per 1/SUB_BUCKETS of their power of 2 */
+int bucketOf(unsigned long long value) {
+    int shift;
+
+    if (value < SUB_BUCKETS) return value;
+    shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+/* Get the lowest value of a bucket */
+unsigned long long bucketValue(int bucket) {
+    int shift = bucket / SUB_BUCKETS - 1;
+
+    if (shift < 0) return bucket;
+    return (unsigned long long) (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+}
+
+/* Get the latencies of the calling thread, adding them to the ones merged at the end on first use */
+latenciesT *threadLatencies() {
+    latenciesT *l = _latencies;
+
+    if (l != NULL) return l;
+    if ((l = calloc(1, sizeof(latenciesT))) == NULL)
+    {
+        perror("Allocation error");
+        exit(EXIT_FAILURE);
+    }
+
+    l->next = __atomic_load_n(&_allLatencies, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&_allLatencies, &l->next, l, 0,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return _latencies = l;
+}
+
+void recordLatency(histogramT *h, unsigned long long value) {
+    h->counts[bucketOf(value)]++;
+    h->total++;
+    if (value > h->max) h->max = value;
+}
+
+/* Add up the latencies of all threads, once they are done recording */
+void mergeLatencies(latenciesT *sum) {
+    latenciesT *l;
+    int i;
+
+    memset(sum, 0, sizeof(latenciesT));
+    for (l = __atomic_load_n(&_allLatencies, __ATOMIC_ACQUIRE); l != NULL; l = l->next)
+    {
+        for (i = 0; i < BUCKETS; i++)
+        {
+            sum->enter.counts[i] += l->enter.counts[i];
+            sum->leave.counts[i] += l->leave.counts[i];
+        }
+        sum->enter.total += l->enter.total;
+        sum->leave.total += l->leave.total;
+        if (l->enter.max > sum->enter.max) sum->enter.max = l->enter.max;
+        if (l->leave.max > sum->leave.max) sum->leave.max = l->leave.max;
+    }
+}
+
+/* Get the lowest value of the bucket holding the given percentile */
+unsigned long long histogramPercentile(histogramT *h, double percentile) {
+    unsigned long long rank = h->total * percentile / 100, seen = 0;
+    int i;
+
+    for (i = 0; i < BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen > rank) return bucketValue(i);
+    }
+
+    return h->max;
+}
+
+/* Print the distribution of a histogram of nanoseconds in microseconds */
+void printHistogram(const char *label, histogramT *h) {
+    fprintf(stderr, "    %-18s p50 %10.2f  p99 %10.2f  p99.9 %10.2f  max %10.2f us\n",
+        label, histogramPercentile(h, 50) / 1e3, histogramPercentile(h, 99) / 1e3,
+        histogramPercentile(h, 99.9) / 1e3, h->max / 1e3);
+}
+
+/*  Take snapshots until stopped, counting what they found. A snapshot that
+ *  ends after the checker was stopped may overlap dusk, when surfers leave
+ *  out of step, so it is not counted.
+ */
+void checkSurfers(void *cptr) {
+    checkerT *c = (checkerT *) cptr;
+    struct timespec interval;
+    unsigned long long start, wait;
+    int found;
+
+    while (!__atomic_load_n(&c->stopping, __ATOMIC_SEQ_CST))
+    {
+        start = nowNs();
+        found = c->takeSnapshot();
+        if (__atomic_load_n(&c->stopping, __ATOMIC_SEQ_CST)) break;
+
+        switch (found & ~SNAPSHOT_PAUSED)
+        {
+        case SNAPSHOT_ALONE:
+            c->alone++;
+            break;
+        case SNAPSHOT_MISCOUNTED:
+            c->miscounted++;
+            break;
+        }
+        if (found & SNAPSHOT_PAUSED) c->paused++;
+        c->snapshots++;
+
+        wait = (nowNs() - start) * SNAPSHOT_SHARE;
+        if (wait < CHECK_INTERVAL) wait = CHECK_INTERVAL;
+        interval.tv_sec = wait / 1000000000;
+        interval.tv_nsec = wait % 1000000000;
+        nanosleep(&interval, NULL);
+    }
+}
+
+/* Start a checker, where takeSnapshot returns what a snapshot of the surfers found */
+void startChecker(checkerT *c, int (*takeSnapshot)()) {
+    int rc;
+
+    memset(c, 0, sizeof(checkerT));
+    c->takeSnapshot = takeSnapshot;
+    rc = pthread_create(&c->thread, NULL, (void *) &checkSurfers, (void *) c);
+    if (rc != 0)
+    {
+        errno = rc;
+        perror("pthread_create error");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Have the checker stop taking snapshots, from any thread, before the surfers are told to leave */
+void stopChecker(checkerT *c) {
+    __atomic_store_n(&c->stopping, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Wait for a stopped checker to finish */
+void joinChecker(checkerT *c) {
+    pthread_join(c->thread, NULL);
+}
+
+#endif
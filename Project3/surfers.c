@@ -8,42 +8,275 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <assert.h>
+#include <sys/resource.h>
 #include "surfers.h"
 #include "surfers_test.c"
+#include "beach.h"
+#include "tasks.h"
+#include "harness.h"
+
+/*  Surfers are admitted into the water through the lock-free beach by default.
+ *  Compile with -D LOCKED_ADMISSION for the original three mutexes, and with
+ *  -D BENCH to have every surfer surf over and over until dusk and report the
+ *  throughput, CPU time per session, latencies, how many surfers completed a
+ *  session, and how often a checker running alongside found fewer than a
+ *  group of surfers surfing at a beach, or the surfers surfing out of step
+ *  with the number the beach counts in the water.
+ *
+ *  Compile with -D MN_TASKS to run the surfers as tasks on a pool of WORKERS
+ *  threads, one per CPU by default, instead of one thread per surfer, which
+ *  lets NSURFERS go up to a million.
+ *
+ *  Compile with -D SHARDS=K to spread the surfer threads over K beaches,
+ *  each pinned with its surfers to one CPU. Surfers who would wait at their
+ *  own beach go in at a neighbouring one instead.
+ *
+ *  Compile with -D GROUP_SIZE=k to have the lock-free beach admit and let
+ *  out surfers k at a time instead of in pairs.
+ */
+#ifndef SHARDS
+#define SHARDS 1
+#endif
+
+#if SHARDS > 1 && (defined(MN_TASKS) || defined(LOCKED_ADMISSION))
+#error "SHARDS only applies to surfer threads on the lock-free beach"
+#endif
+
+#if GROUP_SIZE != 2 && defined(LOCKED_ADMISSION)
+#error "GROUP_SIZE only applies to the lock-free beach"
+#endif
+
+#ifdef BENCH
+#define SESSIONS_PER_SURFER INT_MAX
+#else
+#define SESSIONS_PER_SURFER 1
+#endif
 
 /* Declare synchronization variables */
 int _readyToSurf, _surfersInWater, _readyToLeave;
 pthread_mutex_t readyToSurfLock, surfersInWaterLock, readyToLeaveLock;
 pthread_cond_t canSurf, canLeave;
+beachT _beaches[SHARDS];
 
+/* Number of surf sessions completed */
+int _sessions;
 
-/* Add code to surfer's thread. Surfer MUST call getReady, surf, and leave (in that order) */
-void surfer(void *dptr) {
-    dataT *d=(dataT *)dptr;
-    struct sigaction sa;
-    
-    /* Define signal handler for surfer thread */
-    void sigusr2_handler(int sig)
+/* When the monitor called dusk */
+struct timespec _duskTime;
+
+/*  Added to the number of surfers in water at dusk with LOCKED_ADMISSION, so
+ *  that no surfer waits on it any longer
+ */
+#define DUSK_BIAS (1 << 20)
+
+#ifdef BENCH
+/* Surfers start surfing together once they have all been created */
+pthread_barrier_t _startLine;
+
+checkerT _checker;
+
+/* Sessions completed by each surfer, stored once it is done so that surfers share no counter */
+int _surferSessions[NSURFERS];
+
+/* The surfers, and the beach each one last went surfing at, for the checker */
+dataT **_surfers;
+int _surferBeach[NSURFERS];
+
+/*  MARK notes when a surfer got ready or finished surfing, and RECORD adds
+ *  the time since to the enter or leave latencies of the thread. COUNT adds
+ *  a completed session to the surfer's own count.
+ */
+#define MARK(stamp) ((stamp) = nowNs())
+#define RECORD(side, stamp) recordLatency(&threadLatencies()->side, nowNs() - (stamp))
+#define COUNT(sessions) ((sessions)++)
+#else
+#define MARK(stamp)
+#define RECORD(side, stamp)
+#define COUNT(sessions)
+#endif
+
+#ifndef WORKERS
+#define WORKERS sysconf(_SC_NPROCESSORS_ONLN)
+#endif
+
+/*  Change the number of surfers in water, with surfersInWaterLock held.
+ *  The count is read without the lock by surfers waiting for their partner,
+ *  so it is stored atomically, and those waiters are woken once the count
+ *  moves away from 1.
+ */
+void addSurfersInWater(int delta) {
+#ifdef SPIN_WAIT
+    __atomic_add_fetch(&_surfersInWater, delta, __ATOMIC_RELEASE);
+#else
+    if (__atomic_fetch_add(&_surfersInWater, delta, __ATOMIC_RELEASE) == 1)
     {
-        pthread_mutex_lock(&readyToSurfLock);
-        DPRINTF("\ns%d received signal to leave", d->id);
-        leave(d);
-        pthread_mutex_unlock(&readyToSurfLock);
-        
-        pthread_exit(NULL);
+        futex(&_surfersInWater, FUTEX_WAKE_PRIVATE, INT_MAX);
     }
-    
-    /* Register signal handler for main thread */
-    sa.sa_handler = sigusr2_handler;
-    sa.sa_flags = 0;
-    sigemptyset(&sa.sa_mask);
-    sigaction(SIGUSR2, &sa, NULL);
-    
-    
+#endif
+}
+
+#ifdef BENCH
+#ifndef LOCKED_ADMISSION
+/*  Count the surfers surfing at each beach, and read the census and number
+ *  in the water of each. Returns 0 if a write section was open on a census
+ *  at any point, so that the counts may not be from one instant.
+ */
+int countSurfers(int *surfing, int *toSurf, int *toLeave, int *inWater) {
+    int generations[SHARDS], consistent = 1, i, j;
+
+    for (i = 0; i < SHARDS; i++)
+    {
+        generations[i] = __atomic_load_n(&_beaches[i].census.generation, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&_beaches[i].census.writers, __ATOMIC_SEQ_CST) != 0) return 0;
+        surfing[i] = 0;
+    }
+
+    for (j = 0; j < NSURFERS; j++)
+    {
+        if (__atomic_load_n(&_surfers[j]->state, __ATOMIC_SEQ_CST) == SURFING)
+        {
+            surfing[__atomic_load_n(&_surferBeach[j], __ATOMIC_SEQ_CST)]++;
+        }
+    }
+
+    for (i = 0; i < SHARDS; i++)
+    {
+        toSurf[i] = __atomic_load_n(&_beaches[i].census.toSurf, __ATOMIC_SEQ_CST);
+        toLeave[i] = __atomic_load_n(&_beaches[i].census.toLeave, __ATOMIC_SEQ_CST);
+        inWater[i] = FIELD(__atomic_load_n(&_beaches[i].state, __ATOMIC_SEQ_CST), WATER_SHIFT);
+        if (__atomic_load_n(&_beaches[i].census.writers, __ATOMIC_SEQ_CST) != 0 ||
+            __atomic_load_n(&_beaches[i].census.generation, __ATOMIC_SEQ_CST) != generations[i])
+        {
+            consistent = 0;
+        }
+    }
+
+    return consistent;
+}
+#endif
+
+/*  Take a snapshot of the surfers for the checker. With the mutexes the
+ *  surfers surfing are counted under the lock they change the number in the
+ *  water with. On the lock-free beaches they are counted while no write
+ *  section is open on any census, trying again if one opened meanwhile, and
+ *  pausing the census if that keeps happening. At each beach the surfers
+ *  surfing, plus those let in who have not surfed yet, less those let out
+ *  who have not left yet, must be the number in the water, and fewer than a
+ *  group may only be surfing while some are owed a change of state.
+ */
+int takeSnapshot() {
+#ifdef LOCKED_ADMISSION
+    int surfing = 0, inWater, j;
+
+    pthread_mutex_lock(&surfersInWaterLock);
+    for (j = 0; j < NSURFERS; j++)
+    {
+        if (__atomic_load_n(&_surfers[j]->state, __ATOMIC_RELAXED) == SURFING) surfing++;
+    }
+    inWater = __atomic_load_n(&_surfersInWater, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&surfersInWaterLock);
+
+    if (surfing != inWater) return SNAPSHOT_MISCOUNTED;
+    return surfing > 0 && surfing < GROUP_SIZE ? SNAPSHOT_ALONE : SNAPSHOT_OK;
+#else
+    int surfing[SHARDS], toSurf[SHARDS], toLeave[SHARDS], inWater[SHARDS];
+    int attempt, paused = 0, i;
+
+    for (attempt = 0; attempt < SNAPSHOT_ATTEMPTS; attempt++)
+    {
+        if (countSurfers(surfing, toSurf, toLeave, inWater)) break;
+    }
+
+    if (attempt == SNAPSHOT_ATTEMPTS)
+    {
+        /* Hold back new write sections, and let the open ones close */
+        for (i = 0; i < SHARDS; i++)
+        {
+            __atomic_store_n(&_beaches[i].census.paused, 1, __ATOMIC_SEQ_CST);
+        }
+        for (i = 0; i < SHARDS; i++)
+        {
+            while (__atomic_load_n(&_beaches[i].census.writers, __ATOMIC_SEQ_CST) != 0) sched_yield();
+        }
+        countSurfers(surfing, toSurf, toLeave, inWater);
+        for (i = 0; i < SHARDS; i++)
+        {
+            __atomic_store_n(&_beaches[i].census.paused, 0, __ATOMIC_SEQ_CST);
+        }
+        paused = SNAPSHOT_PAUSED;
+    }
+
+    for (i = 0; i < SHARDS; i++)
+    {
+        if (surfing[i] + toSurf[i] - toLeave[i] != inWater[i]) return SNAPSHOT_MISCOUNTED | paused;
+    }
+    for (i = 0; i < SHARDS; i++)
+    {
+        if (surfing[i] > 0 && surfing[i] < GROUP_SIZE && toSurf[i] == 0 && toLeave[i] == 0)
+        {
+            return SNAPSHOT_ALONE | paused;
+        }
+    }
+
+    return SNAPSHOT_OK | paused;
+#endif
+}
+#endif
+
+#ifndef LOCKED_ADMISSION
+/*  Surf at a beach once let into the water there. With BENCH the state of
+ *  the surfer changes in the same write section as the census it was owed by.
+ */
+void surfAt(beachT *b, dataT *d) {
+    CENSUS_BEGIN(b);
+#ifdef BENCH
+    __atomic_store_n(&_surferBeach[d->id], b - _beaches, __ATOMIC_SEQ_CST);
+#endif
+    surf(d);
+    CENSUS_ADD(b, toSurf, -1);
+    CENSUS_END(b);
+}
+
+/* Leave a beach once let out of the water there, settling the census likewise */
+void leaveAt(beachT *b, dataT *d) {
+    CENSUS_BEGIN(b);
+    leave(d);
+    CENSUS_ADD(b, toLeave, -1);
+    CENSUS_END(b);
+}
+#endif
+
+/*  Wait, without holding any lock, while the surfer is alone in the water.
+ *  With SPIN_WAIT defined the surfer busy-waits instead, which is kept to
+ *  compare the CPU time of the two.
+ */
+void waitForPartner() {
+    int inWater;
+
+    while ((inWater = __atomic_load_n(&_surfersInWater, __ATOMIC_ACQUIRE)) == 1)
+    {
+#ifndef SPIN_WAIT
+        futex(&_surfersInWater, FUTEX_WAIT_PRIVATE, inWater);
+#endif
+    }
+}
+
+
+#ifdef LOCKED_ADMISSION
+/*  Run one session with the three counters behind their own mutexes and
+ *  condition variables, kept to compare against the lock-free beach.
+ *  Returns 0 if the surfer left at dusk without surfing to the end.
+ */
+int lockedSession(dataT *d) {
+#ifdef BENCH
+    unsigned long long readyAt, doneAt;
+#endif
+
     /* Surfer is arrives and gets ready */
     pthread_mutex_lock(&readyToSurfLock);
         //if(d->id > 1) //THIS HAS CHANGED
     getReady(d);
+    MARK(readyAt);
     _readyToSurf++;
     DPRINTF("\ns%d is ready, _readyToSurf = %d", d->id, _readyToSurf);
     /* Signal any surfer if waiting to surf */
@@ -83,13 +316,19 @@ void surfer(void *dptr) {
     }
     pthread_mutex_unlock(&readyToSurfLock);
     
+    if (beachClosed(&_beaches[0]))
+    {
+        leave(d);
+        return 0;
+    }
     DPRINTF("\ns%d can now surf", d->id);
     
     /* Initiate surfing */
     pthread_mutex_lock(&readyToSurfLock);
     pthread_mutex_lock(&surfersInWaterLock);
+    RECORD(enter, readyAt);
     surf(d);
-    _surfersInWater++;
+    addSurfersInWater(1);
     DPRINTF(", _surfersInWater = %d", _surfersInWater);
     /* Signal any surfer waiting to leave, as that surfer can leave
      * since there is one more surfer in water now.
@@ -103,8 +342,13 @@ void surfer(void *dptr) {
     /* Ensure that the other surfer comes in with him,
      * so that he is not alone in water.
      */
-    while (_surfersInWater == 1);
+    waitForPartner();
     
+    if (beachClosed(&_beaches[0]))
+    {
+        leave(d);
+        return 0;
+    }
     
     /*************************
      * Surfer is surfing now *
@@ -112,6 +356,7 @@ void surfer(void *dptr) {
     
     
     /* Signal any waiting surfer ready to leave */
+    MARK(doneAt);
     pthread_mutex_lock(&readyToLeaveLock);
     _readyToLeave++;
     DPRINTF("\ns%d is ready to leave, %d", d->id, _readyToLeave);
@@ -149,8 +394,9 @@ void surfer(void *dptr) {
     /* Initiate leave */
     pthread_mutex_lock(&readyToLeaveLock);
     pthread_mutex_lock(&surfersInWaterLock);
+    RECORD(leave, doneAt);
     leave(d);
-    _surfersInWater--;
+    addSurfersInWater(-1);
     DPRINTF(", _surfersInWater = %d", _surfersInWater);
     pthread_mutex_unlock(&surfersInWaterLock);
     _readyToLeave--;
@@ -161,12 +407,372 @@ void surfer(void *dptr) {
     /***********************
      * Surfer has left now *
      ***********************/
+
+    return 1;
+}
+#endif
+
+/* Add code to surfer's thread. Surfer MUST call getReady, surf, and leave (in that order) */
+void surfer(void *dptr) {
+    dataT *d=(dataT *)dptr;
+    int i;
+#if defined(BENCH) && !defined(LOCKED_ADMISSION)
+    unsigned long long readyAt, doneAt;
+#endif
+#ifdef BENCH
+    int completed = 0;
+#endif
+#ifndef LOCKED_ADMISSION
+    int home = d->id % SHARDS;
+    beachT *b;
+#endif
+#if SHARDS > 1
+    cpu_set_t cpus;
+
+    /* Run next to the beach, on the CPU it is pinned to */
+    CPU_ZERO(&cpus);
+    CPU_SET(home % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+    
+#ifdef BENCH
+    pthread_barrier_wait(&_startLine);
+#endif
+    for (i = 0; i < SESSIONS_PER_SURFER && !beachClosed(&_beaches[0]); i++)
+    {
+#ifdef LOCKED_ADMISSION
+        if (lockedSession(d)) COUNT(completed);
+#else
+        /*  Arrive, go in with a group, surf, and leave without leaving fewer
+         *  than a group. A surfer still waiting at dusk leaves right away.
+         */
+        getReady(d);
+        MARK(readyAt);
+        if ((b = enterAnyWater(_beaches, SHARDS, home)) == NULL)
+        {
+            leave(d);
+        }
+        else
+        {
+            RECORD(enter, readyAt);
+            surfAt(b, d);
+            MARK(doneAt);
+            if (leaveWater(b))
+            {
+                RECORD(leave, doneAt);
+                COUNT(completed);
+                leaveAt(b, d);
+            }
+            else
+            {
+                leave(d);
+            }
+        }
+#endif
+        __atomic_add_fetch(&_sessions, 1, __ATOMIC_RELAXED);
+    }
+#ifdef BENCH
+    _surferSessions[d->id] = completed;
+#endif
+}
+
+#ifdef BENCH
+/*  Report the sessions completed until dusk, the CPU time and context
+ *  switches of all threads per session, the time from dusk until the last
+ *  surfer left, and how evenly the sessions went round the surfers
+ */
+void reportBench(struct timespec *start) {
+    struct rusage usage;
+    struct timespec end;
+    latenciesT latencies;
+    int sessions = __atomic_load_n(&_sessions, __ATOMIC_RELAXED);
+    int surfed = 0, fewest = INT_MAX, most = 0, j;
+    double cpuTime, elapsed, shutdown;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &usage);
+    elapsed = _duskTime.tv_sec - start->tv_sec +
+        (_duskTime.tv_nsec - start->tv_nsec) / 1e9;
+    shutdown = end.tv_sec - _duskTime.tv_sec +
+        (end.tv_nsec - _duskTime.tv_nsec) / 1e9;
+    cpuTime = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    if (sessions == 0) sessions = 1;
+
+    fprintf(stderr, "%-14s %7d surfers k=%-2d %12.1f sessions/s %8.2f us CPU/session "
+        "%6.2f switches/session %10.1f us shutdown\n",
+#if defined(MN_TASKS)
+        "M:N tasks",
+#elif defined(LOCKED_ADMISSION) && defined(SPIN_WAIT)
+        "locked, spin",
+#elif defined(LOCKED_ADMISSION)
+        "locked, futex",
+#elif SHARDS > 1
+        "sharded",
+#else
+        "lock-free",
+#endif
+        NSURFERS, GROUP_SIZE, sessions / elapsed, cpuTime * 1e6 / sessions,
+        (double) (usage.ru_nvcsw + usage.ru_nivcsw) / sessions, shutdown * 1e6);
+
+    mergeLatencies(&latencies);
+    printHistogram("ready to surfing", &latencies.enter);
+    printHistogram("ready to leave", &latencies.leave);
+
+    for (j = 0; j < NSURFERS; j++)
+    {
+        if (_surferSessions[j] > 0) surfed++;
+        if (_surferSessions[j] < fewest) fewest = _surferSessions[j];
+        if (_surferSessions[j] > most) most = _surferSessions[j];
+    }
+    fprintf(stderr, "    %-18s %d of %d surfers completed a session, fewest %d, most %d sessions\n",
+        "fairness", surfed, NSURFERS, fewest, most);
+
+    joinChecker(&_checker);
+    fprintf(stderr, "    %-18s %llu snapshots, %llu with fewer than k surfers surfing, "
+        "%llu miscounted, %llu taken paused\n", "invariant", _checker.snapshots, _checker.alone,
+        _checker.miscounted, _checker.paused);
+}
+#endif
+
+#ifdef MN_TASKS
+/* Steps of a surfer task, each the one to run when it is next scheduled */
+#define STEP_ARRIVE 0
+#define STEP_SURF 1
+#define STEP_LEAVE 2
+
+/* A surfer run as a task rather than a thread */
+typedef struct surferTask {
+    taskT task;
+    dataT *d;
+    int step;
+    int sessions;
+    unsigned long long stamp;
+} surferTaskT;
+
+/*  Surfer tasks parked on one side of the beach. A surfer released before it
+ *  got to park leaves a token instead, which it takes rather than parking.
+ */
+typedef struct parkingLot {
+    pthread_mutex_t lock;
+    int tokens;
+    taskT *head, *tail;
+} parkingLotT;
+
+parkingLotT _enterLot, _leaveLot;
+
+/*  Schedule the first count surfers parked in the lot together, leaving a
+ *  token for each one that has not parked yet
+ */
+void releaseTasks(parkingLotT *lot, int count) {
+    taskT *head, *last = NULL;
+    int n = 0;
+
+    pthread_mutex_lock(&lot->lock);
+    head = lot->head;
+    while (n < count && lot->head != NULL)
+    {
+        last = lot->head;
+        lot->head = last->next;
+        n++;
+    }
+    lot->tokens += count - n;
+    pthread_mutex_unlock(&lot->lock);
+
+    if (n > 0)
+    {
+        last->next = NULL;
+        scheduleTasks(head, n);
+    }
+}
+
+/* Park the surfer in the lot unless a token is waiting. Returns 1 if parked. */
+int parkTask(parkingLotT *lot, taskT *t) {
+    pthread_mutex_lock(&lot->lock);
+    if (lot->tokens > 0)
+    {
+        lot->tokens--;
+        pthread_mutex_unlock(&lot->lock);
+        return 0;
+    }
+
+    t->next = NULL;
+    if (lot->head == NULL)
+    {
+        lot->head = t;
+    }
+    else
+    {
+        lot->tail->next = t;
+    }
+    lot->tail = t;
+    pthread_mutex_unlock(&lot->lock);
+
+    return 1;
+}
+
+/* Same as enterWater(), but parks the task instead of blocking. Returns 1 if parked. */
+int enterWaterTask(taskT *t) {
+    unsigned long long state;
+
+    switch (arriveAtBeach(&_beaches[0], &state, 1))
+    {
+    case ALONE:
+        if (FIELD(state, LEAVE_SHIFT) > 0 && releaseLeaver(&_beaches[0]))
+        {
+            releaseTasks(&_leaveLot, 1);
+        }
+        return 0;
+
+    case GROUPED:
+        releaseTasks(&_enterLot, GROUP_SIZE - 1);
+        return 0;
+    }
+
+    return parkTask(&_enterLot, t);
+}
+
+/* Same as leaveWater(), but parks the task instead of blocking. Returns 1 if parked. */
+int leaveWaterTask(taskT *t) {
+    switch (finishSurfing(&_beaches[0]))
+    {
+    case ALONE:
+        return 0;
+
+    case GROUPED:
+        releaseTasks(&_leaveLot, GROUP_SIZE - 1);
+        return 0;
+    }
+
+    return parkTask(&_leaveLot, t);
+}
+
+/*  Run a surfer task from where it last stopped. Once parked, the task may
+ *  already be running on another worker, so it is not touched again here.
+ */
+int surferTask(taskT *t) {
+    surferTaskT *s = (surferTaskT *) t;
+
+    switch (s->step)
+    {
+    case STEP_ARRIVE:
+        if (beachClosed(&_beaches[0])) return TASK_DONE;
+        getReady(s->d);
+        MARK(s->stamp);
+        s->step = STEP_SURF;
+        if (enterWaterTask(t)) return TASK_PARKED;
+        /* fall through */
+
+    case STEP_SURF:
+        RECORD(enter, s->stamp);
+        surfAt(&_beaches[0], s->d);
+        MARK(s->stamp);
+        s->step = STEP_LEAVE;
+        if (leaveWaterTask(t)) return TASK_PARKED;
+        /* fall through */
+
+    case STEP_LEAVE:
+        RECORD(leave, s->stamp);
+        leaveAt(&_beaches[0], s->d);
+        s->step = STEP_ARRIVE;
+        __atomic_add_fetch(&_sessions, 1, __ATOMIC_RELAXED);
+        break;
+    }
+
+    return ++s->sessions < SESSIONS_PER_SURFER ? TASK_YIELD : TASK_DONE;
+}
+
+/*  Run all surfers as tasks until they are done, or until dusk stops the
+ *  pool. Surfers still on the beach or in the water at dusk then leave.
+ */
+void runSurferTasks(dataT **ds) {
+    surferTaskT *tasks = calloc(NSURFERS, sizeof(surferTaskT));
+    int j;
+#ifdef BENCH
+    struct timespec start;
+#endif
+
+    if (tasks == NULL)
+    {
+        perror("Allocation error");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&_enterLot.lock, NULL);
+    pthread_mutex_init(&_leaveLot.lock, NULL);
+
+    initPool(WORKERS, NSURFERS);
+    for (j = 0; j < NSURFERS; j++)
+    {
+        ds[j]->id = j;
+        tasks[j].task.run = surferTask;
+        tasks[j].d = ds[j];
+        spawnTask(&tasks[j].task);
+    }
+
+#ifdef BENCH
+    _surfers = ds;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    startChecker(&_checker, takeSnapshot);
+#endif
+    startPool();
+    joinPool();
+
+    for (j = 0; j < NSURFERS; j++)
+    {
+        if (tasks[j].step != STEP_ARRIVE) leave(ds[j]);
+#ifdef BENCH
+        _surferSessions[j] = tasks[j].sessions;
+#endif
+    }
+#ifdef BENCH
+    reportBench(&start);
+#endif
+
+    pthread_mutex_destroy(&_enterLot.lock);
+    pthread_mutex_destroy(&_leaveLot.lock);
+    free(tasks);
+}
+#endif
+
+/*  Called by the monitor at dusk. Closes the beach, which wakes every surfer
+ *  waiting on it at once, rather than signalling the surfers one by one.
+ */
+void duskBroadcast() {
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &_duskTime);
+#ifdef BENCH
+    stopChecker(&_checker);
+#endif
+    for (i = 0; i < SHARDS; i++) closeBeach(&_beaches[i]);
+
+#ifdef MN_TASKS
+    /* Surfer tasks hold no thread to wake, so stop the workers and let main see them out */
+    stopPool();
+#endif
+
+#ifdef LOCKED_ADMISSION
+    /* Break every wait on the counters, and wake the surfers in them */
+    pthread_mutex_lock(&readyToSurfLock);
+    pthread_mutex_lock(&surfersInWaterLock);
+    addSurfersInWater(DUSK_BIAS);
+    futex(&_surfersInWater, FUTEX_WAKE_PRIVATE, INT_MAX);
+    pthread_cond_broadcast(&canSurf);
+    pthread_mutex_unlock(&surfersInWaterLock);
+    pthread_mutex_unlock(&readyToSurfLock);
+
+    pthread_mutex_lock(&readyToLeaveLock);
+    pthread_cond_broadcast(&canLeave);
+    pthread_mutex_unlock(&readyToLeaveLock);
+#endif
 }
 
 /* Add code to main (DO NOT remove initialization code) */
 int main() {
-    int j=0, rc;
-    struct sigaction sa;
+    int j=0;
+#ifndef MN_TASKS
+    int rc;
+#endif
 
     /* Initialize synchronization variables */
     if (sem_init(&dusk, 0, 0) == -1) { perror("sem_init"); } // THIS HAS CHANGED
@@ -179,53 +785,35 @@ int main() {
     pthread_cond_init(&canSurf, NULL);
     pthread_cond_init(&canLeave, NULL);
     sem_init(&monitor_mutex, 0, 1);
+    startLog();
     
 
     /* Initialize thread data structures */
+#ifndef MN_TASKS
     pthread_t t[NSURFERS];
+#endif
     dataT **ds = malloc(sizeof(dataT) * NSURFERS);
-    for (j=0; j<NSURFERS; j++) { ds[j] = malloc(sizeof(struct data)); }
+    for (j=0; j<NSURFERS; j++) { ds[j] = calloc(1, sizeof(struct data)); }
 
     /* s1 and s2 start surfing */ //THIS HAS CHANGED
     /*surf(ds[0]);  //THIS HAS CHANGED
         surf(ds[1]);*/ //THIS HAS CHANGED
-        
-    /* Define the signal handler for main thread */
-    void sigusr1_handler(int sig)
-    {
-        int i;
-        
-        DPRINTF("\nReceived dusk signal from monitor");
-        
-        /*  Check if any of the surfers are in READY or SURFING state,
-         *  and signal them to leave
-         */
-        for (i = 0; i < NSURFERS; i++)
-        {
-            sem_wait(&monitor_mutex);
-            if (ds[i]->state == READY || ds[i]->state == SURFING)
-            {
-                sem_post(&monitor_mutex);
-                pthread_kill(t[i], SIGUSR2);
-            }
-            else
-            {
-                sem_post(&monitor_mutex);
-            }
-        }
-    }
+
 
     /* Create monitor */
     pthread_t mon;
     pthread_create(&mon, NULL, (void *)&monitor, (void *)ds);
     printf("The sharks are in the water");
 
-    /* Register signal handler for main thread */
-    sa.sa_handler = sigusr1_handler;
-    sa.sa_flags = 0;
-    sigemptyset(&sa.sa_mask);
-    sigaction(SIGUSR1, &sa, NULL);
-    
+#if defined(MN_TASKS)
+    runSurferTasks(ds);
+#else
+#ifdef BENCH
+    struct timespec start;
+
+    pthread_barrier_init(&_startLine, NULL, NSURFERS + 1);
+#endif
+
     /* Create surfers */
     for (j = 0; j < NSURFERS; j++)
     {
@@ -234,15 +822,29 @@ int main() {
         assert(rc == 0);
     }
     
+#ifdef BENCH
+    /* Release the surfers together. They keep surfing until dusk. */
+    pthread_barrier_wait(&_startLine);
+    _surfers = ds;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    startChecker(&_checker, takeSnapshot);
+#endif
+
     /* Wait for surfers to finish */
     for (j = 0; j < NSURFERS; j++)
     {
         rc = pthread_join(t[j], NULL);
         assert(rc == 0);
     }
+#ifdef BENCH
+    reportBench(&start);
+#endif
+#endif
 
     /* Wait for monitor to finish */
     pthread_join(mon, NULL);
+    stopLog();
+
 
     /* Clean up synchronization variables */ 
     pthread_mutex_destroy(&readyToSurfLock);
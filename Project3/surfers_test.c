@@ -1,7 +1,10 @@
 //#include "surfers.h" /* has dataT, NSURFERS */ // ->> Commented this out as it is already included in surfers.c
+#include "eventlog.h"
 
 /* Set the time till dusk in seconds */
+#ifndef TILL_DUSK
 #define TILL_DUSK 1
+#endif
 
 /* Define a debug printf() fuction that can be activated on comiling with -D DEBUG */
 #ifdef DEBUG
@@ -10,28 +13,29 @@
 #define DPRINTF(format, args...)
 #endif
 
+/* Tell every surfer to leave, defined with the surfers */
+void duskBroadcast();
+
+/*  The state of each surfer is stored atomically so that it can be read
+ *  without a lock, and events go to the asynchronous log instead of being
+ *  printed under monitor_mutex
+ */
 void surf(dataT *d) {
     
-    sem_wait(&monitor_mutex);
-    d->state = SURFING;
-    printf("\ns%d is surfing", d->id);
-    sem_post(&monitor_mutex);
+    __atomic_store_n(&d->state, SURFING, __ATOMIC_RELEASE);
+    logEvent(d->id, SURFING);
 }
 
 void leave(dataT *d) {
     
-    sem_wait(&monitor_mutex);
-    d->state = LEAVE;
-    printf("\ns%d leaves", d->id);
-    sem_post(&monitor_mutex);
+    __atomic_store_n(&d->state, LEAVE, __ATOMIC_RELEASE);
+    logEvent(d->id, LEAVE);
 }
 
 void getReady(dataT *d) {
     
-    sem_wait(&monitor_mutex);
-    d->state = READY;
-    printf("\ns%d arrives", d->id);
-    sem_post(&monitor_mutex);
+    __atomic_store_n(&d->state, READY, __ATOMIC_RELEASE);
+    logEvent(d->id, READY);
 }
 
 void monitor(void * x) {
@@ -44,15 +48,10 @@ void monitor(void * x) {
     if(sem_timedwait(&dusk, &ts) == -1 && errno == ETIMEDOUT)
     {
         DPRINTF("\nIt's dusk. Signalling surfers, if any, to leave.\n");
-        /*  We dont have accesss to the thread ids for surfers in this method,
-         *  so we send a signal to the main thread (who has the surfer thread ids).
-         *  The main thread will again signal each of the active (READY or SURFING)
-         *  threads to LEAVE.
-         * 
-         *  If we had access to the thread ids, we wouldn't have to do this is such
-         *  a roundabout way. We could've sent the signal directly to the surfer threads.
-         *  -_-+
+        /*  Close the beach in one step rather than signalling surfers one by
+         *  one. Every waiting surfer wakes at once and the active (READY or
+         *  SURFING) ones LEAVE on their own.
          */
-        kill(getpid(), SIGUSR1);
+        duskBroadcast();
     }
 }
@@ -0,0 +1,265 @@
+/*  tasks.h
+ *
+ *  M:N scheduler running lightweight tasks on a fixed pool of worker threads.
+ *
+ *  A task is a state machine: its run function does some work and returns
+ *  whether the task is done, should run again later, or has parked itself.
+ *  A parked task holds no thread; whoever releases it hands it back to the
+ *  scheduler with scheduleTask(). Nothing of the task may be touched by the
+ *  thread that parked it once it is visible to whoever releases it.
+ *
+ *  Every worker owns a Chase-Lev deque. It pushes tasks at the bottom of its
+ *  own deque but takes them from the top, the same end the other workers
+ *  steal from when their own deques are empty. The deque is then a FIFO run
+ *  queue: a task that yields or is released runs again only after every
+ *  task already waiting, so no task is starved by a few that keep releasing
+ *  each other. Idle workers sleep on an eventcount until a task is scheduled
+ *  or the pool is stopped.
+ */
+
+#ifndef TASKS_H
+#define TASKS_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "beach.h"
+
+/* What a task asks of its worker when its run function returns */
+#define TASK_DONE 0
+#define TASK_YIELD 1
+#define TASK_PARKED 2
+
+/* A task, to be embedded at the start of a larger structure */
+typedef struct task {
+    int (*run)(struct task *);
+    struct task *next;
+} taskT;
+
+/* Work-stealing deque of one worker, with its ends on their own cache lines */
+typedef struct deque {
+    long top __attribute__((aligned(64)));
+    long bottom __attribute__((aligned(64)));
+    taskT **buffer;
+    long mask;
+} dequeT;
+
+typedef struct worker {
+    dequeT deque;
+    pthread_t thread;
+    unsigned int seed;
+} workerT;
+
+/* The pool of workers, and the number of tasks that are not done yet */
+typedef struct pool {
+    workerT *workers;
+    int numWorkers;
+    int remaining __attribute__((aligned(64)));
+    int stopping;
+    eventT idle;
+} poolT;
+
+poolT _pool;
+
+/* The worker running on this thread */
+__thread workerT *_currentWorker;
+
+/* Push a task at the bottom of the deque. Only its owner may do this. */
+void pushTask(dequeT *q, taskT *t) {
+    long bottom = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&q->buffer[bottom & q->mask], t, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&q->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+/* Steal a task from the top of a deque. Returns NULL if it is empty or another worker took the task first. */
+taskT *stealTask(dequeT *q) {
+    long top = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    long bottom;
+    taskT *t;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bottom = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) return NULL;
+
+    t = __atomic_load_n(&q->buffer[top & q->mask], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&q->top, &top, top + 1, 0,
+        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        return NULL;
+    }
+
+    return t;
+}
+
+/* Take the oldest task from the own deque, at the top where the thieves race for it */
+taskT *takeTask(dequeT *q) {
+    taskT *t;
+
+    while ((t = stealTask(q)) == NULL)
+    {
+        if (__atomic_load_n(&q->top, __ATOMIC_ACQUIRE) >=
+            __atomic_load_n(&q->bottom, __ATOMIC_RELAXED))
+        {
+            return NULL;
+        }
+    }
+
+    return t;
+}
+
+/* Try every other worker once, starting from a random one */
+taskT *findTask(workerT *self) {
+    taskT *t;
+    int start = rand_r(&self->seed) % _pool.numWorkers, i;
+
+    for (i = 0; i < _pool.numWorkers; i++)
+    {
+        workerT *victim = &_pool.workers[(start + i) % _pool.numWorkers];
+
+        if (victim == self) continue;
+        if ((t = stealTask(&victim->deque)) != NULL) return t;
+    }
+
+    return NULL;
+}
+
+/* Hand a released or new task to the worker running this thread, behind the tasks it has waiting, and wake an idle one to steal it */
+void scheduleTask(taskT *t) {
+    pushTask(&_currentWorker->deque, t);
+    postEvent(&_pool.idle, 1);
+}
+
+/* Hand count released tasks, linked through next, to this worker in that order, and wake as many idle ones at once */
+void scheduleTasks(taskT *head, int count) {
+    taskT *t, *next;
+
+    for (t = head; t != NULL; t = next)
+    {
+        next = t->next;
+        pushTask(&_currentWorker->deque, t);
+    }
+    postEvent(&_pool.idle, count);
+}
+
+/* Check whether the workers have nothing left to wait for */
+int poolFinished() {
+    return __atomic_load_n(&_pool.stopping, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&_pool.remaining, __ATOMIC_ACQUIRE) == 0;
+}
+
+/* Run tasks from the own deque, oldest first, or stolen ones, until the pool is finished */
+void worker(void *wptr) {
+    workerT *self = (workerT *) wptr;
+    taskT *t;
+    int seen;
+
+    _currentWorker = self;
+    while (!poolFinished())
+    {
+        if ((t = takeTask(&self->deque)) == NULL && (t = findTask(self)) == NULL)
+        {
+            /* Look once more after reading the eventcount, so that a task scheduled meanwhile is not missed */
+            seen = readEvent(&_pool.idle);
+            if ((t = findTask(self)) == NULL)
+            {
+                if (!poolFinished()) awaitEvent(&_pool.idle, seen);
+                continue;
+            }
+        }
+
+        switch (t->run(t))
+        {
+        case TASK_DONE:
+            if (__atomic_sub_fetch(&_pool.remaining, 1, __ATOMIC_ACQ_REL) == 0)
+            {
+                postEvent(&_pool.idle, INT_MAX);
+            }
+            break;
+
+        case TASK_YIELD:
+            /* Behind every task already waiting */
+            pushTask(&self->deque, t);
+            break;
+        }
+    }
+}
+
+/*  Set up the pool for numWorkers workers and up to capacity tasks. Every
+ *  deque can hold all tasks, which costs only address space until used.
+ */
+void initPool(int numWorkers, int capacity) {
+    long size = 1;
+    int i;
+
+    while (size < capacity) size *= 2;
+
+    _pool.numWorkers = numWorkers;
+    _pool.workers = calloc(numWorkers, sizeof(workerT));
+    if (_pool.workers == NULL)
+    {
+        perror("Allocation error");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < numWorkers; i++)
+    {
+        _pool.workers[i].deque.buffer = calloc(size, sizeof(taskT *));
+        if (_pool.workers[i].deque.buffer == NULL)
+        {
+            perror("Allocation error");
+            exit(EXIT_FAILURE);
+        }
+        _pool.workers[i].deque.mask = size - 1;
+        _pool.workers[i].seed = i + 1;
+    }
+}
+
+/* Add a task before the pool is started, spreading tasks over the workers */
+void spawnTask(taskT *t) {
+    pushTask(&_pool.workers[_pool.remaining % _pool.numWorkers].deque, t);
+    _pool.remaining++;
+}
+
+/* Start the workers */
+void startPool() {
+    int i, rc;
+
+    for (i = 0; i < _pool.numWorkers; i++)
+    {
+        rc = pthread_create(&_pool.workers[i].thread, NULL, (void *) &worker,
+            (void *) &_pool.workers[i]);
+        if (rc != 0)
+        {
+            errno = rc;
+            perror("pthread_create error");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*  Have the workers return after the task they are running, leaving any
+ *  parked or queued tasks behind. Only uses atomics and the futex system
+ *  call, so it may be called from a signal handler.
+ */
+void stopPool() {
+    __atomic_store_n(&_pool.stopping, 1, __ATOMIC_RELEASE);
+    postEvent(&_pool.idle, INT_MAX);
+}
+
+/* Wait for the workers to return and free the pool */
+void joinPool() {
+    int i;
+
+    for (i = 0; i < _pool.numWorkers; i++)
+    {
+        pthread_join(_pool.workers[i].thread, NULL);
+        free(_pool.workers[i].deque.buffer);
+    }
+    free(_pool.workers);
+}
+
+#endif
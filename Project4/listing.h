@@ -0,0 +1,530 @@
+/*  listing.h
+ *
+ *  Sorted directory listing with bounded memory for myls.
+ *
+ *  Entries are gathered into an arena: their names one after another in one
+ *  buffer, and for each a small record holding the first 8 bytes of its name,
+ *  its sort key, and where its name and statistics are. Names are sorted by
+ *  an MSD radix sort that reads the 8-byte prefixes held in the records and
+ *  only goes to the names in the arena past them, so most of the sort streams
+ *  through the records. Sorting by time or size then runs a stable LSD radix
+ *  sort over the keys, which keeps entries with equal keys in name order.
+ *
+ *  The arrays of the arena double as they fill. Rather than double one past
+ *  MEMORY_BUDGET, counting every array as allocated along with the scratch
+ *  space of the sort and what the caller reserved, the entries are sorted and
+ *  written to a temporary file as a run, and the arena starts over in the
+ *  space it has. The runs are then merged through a heap while the listing is
+ *  read back, so a directory of any size is listed in order with memory
+ *  bounded by the budget.
+ */
+
+#ifndef LISTING_H
+#define LISTING_H
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Orders of the listing */
+#define SORT_NONE 0
+#define SORT_NAME 1
+#define SORT_TIME 2
+#define SORT_SIZE 3
+
+/* Bytes the listing may allocate, with what its caller reserved, before a run is written out */
+#ifndef MEMORY_BUDGET
+#define MEMORY_BUDGET (256L << 20)
+#endif
+
+/* Number of entries below which the radix sort hands over to insertion sort */
+#define INSERTION_SORT_SIZE 32
+
+/* The statistics of an entry shown by the long listing */
+typedef struct fileInfo
+{
+    unsigned int mode, nlink, uid, gid, mtimeNsec;
+    unsigned long long size;
+    long long mtime;
+} fileInfoT;
+
+/* Record of an entry in the arena */
+typedef struct listEntry
+{
+    unsigned long long prefix;  /* first 8 bytes of the name, big-endian, padded with zeros */
+    unsigned long long key;     /* sorts in the order of the listing, for every order but name */
+    long name;                  /* where the name is in the arena */
+    int length;
+    int info;                   /* index of the statistics, or -1 */
+} listEntryT;
+
+/* Entry as written to a run, followed by its name */
+typedef struct runRecord
+{
+    unsigned long long prefix, key;
+    int length, hasInfo;
+    fileInfoT info;
+} runRecordT;
+
+/* Next entry of a run being merged */
+typedef struct runCursor
+{
+    FILE *file;
+    runRecordT record;
+    char name[NAME_MAX + 1];
+} runCursorT;
+
+typedef struct listing
+{
+    int sortBy, keepInfo;
+    char *names;
+    listEntryT *entries;
+    fileInfoT *infos;
+    long namesLength, namesCapacity;
+    long numEntries, entriesCapacity;
+    long numInfos, infosCapacity;
+    unsigned long long added;
+
+    /* Bytes the caller holds besides the listing, counted against the budget */
+    long reserved;
+
+    /* Runs written out, and the heap merging them */
+    runCursorT *runs;
+    int numRuns, heapSize;
+
+    /* Where reading back is, and the entry read last from the runs */
+    long next;
+    runRecordT current;
+    char currentName[NAME_MAX + 1];
+} listingT;
+
+/* Start an empty listing in the given order, keeping the statistics of the entries if keepInfo is set */
+void initListing(listingT *l, int sortBy, int keepInfo)
+{
+    memset(l, 0, sizeof(listingT));
+    l->sortBy = sortBy;
+    l->keepInfo = keepInfo;
+}
+
+/* Get the capacity an array doubles to, from 1024 elements, to hold at least needed */
+long grownCapacity(long needed, long capacity)
+{
+    if (needed <= capacity) return capacity;
+
+    if (capacity == 0) capacity = 1024;
+    while (capacity < needed) capacity *= 2;
+
+    return capacity;
+}
+
+/* Grow an array, doubling it, to hold at least needed elements and handle errors */
+void *growArray(void *array, long needed, long *capacity, size_t size)
+{
+    if (needed <= *capacity) return array;
+
+    *capacity = grownCapacity(needed, *capacity);
+    if ((array = realloc(array, *capacity * size)) == NULL)
+    {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+
+    return array;
+}
+
+/* Get the first 8 bytes of a name as a big-endian number, padded with zeros */
+unsigned long long namePrefix(const char *name, int length)
+{
+    unsigned long long prefix = 0;
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        prefix = prefix << 8 | (i < length ? (unsigned char) name[i] : 0);
+    }
+
+    return prefix;
+}
+
+/* Get the key of an entry that sorts in the order of the listing, newest or largest first */
+unsigned long long sortKey(listingT *l, const fileInfoT *info)
+{
+    switch (l->sortBy)
+    {
+    case SORT_TIME:
+        /* Flip the sign bit so that signed times compare as unsigned, then reverse */
+        return ~((unsigned long long) (info->mtime * 1000000000LL + info->mtimeNsec) ^ 1ULL << 63);
+
+    case SORT_SIZE:
+        return ~info->size;
+
+    case SORT_NONE:
+        /* Keep the order the entries came in */
+        return l->added;
+    }
+
+    return 0;
+}
+
+/* Compare two names as memcmp() does, the shorter first when one starts the other */
+int compareNames(const char *a, int aLength, const char *b, int bLength)
+{
+    int c = memcmp(a, b, aLength < bLength ? aLength : bLength);
+
+    return c != 0 ? c : aLength - bLength;
+}
+
+/* Compare two entries of the arena by name, knowing they agree on the first depth bytes */
+int compareEntries(listingT *l, listEntryT *a, listEntryT *b, int depth)
+{
+    if (depth < 8 && a->prefix != b->prefix) return a->prefix < b->prefix ? -1 : 1;
+    if (depth < 8) depth = 8;
+    if (a->length <= depth || b->length <= depth) return a->length - b->length;
+
+    return compareNames(l->names + a->name + depth, a->length - depth,
+                        l->names + b->name + depth, b->length - depth);
+}
+
+/* Get the byte of the name of an entry at depth, or 0 past its end, since names hold no 0 bytes */
+unsigned int nameByte(listingT *l, listEntryT *e, int depth)
+{
+    if (depth < 8) return e->prefix >> (56 - 8 * depth) & 0xff;
+    return depth < e->length ? (unsigned char) l->names[e->name + depth] : 0;
+}
+
+/* Sort entries that agree on the first depth bytes of their names by insertion */
+void insertionSort(listingT *l, listEntryT *entries, long count, int depth)
+{
+    listEntryT e;
+    long i, j;
+
+    for (i = 1; i < count; i++)
+    {
+        e = entries[i];
+        for (j = i; j > 0 && compareEntries(l, &e, &entries[j - 1], depth) < 0; j--)
+        {
+            entries[j] = entries[j - 1];
+        }
+        entries[j] = e;
+    }
+}
+
+/*  Sort entries that agree on the first depth bytes of their names by the
+ *  byte at depth, then each bucket by the bytes after it. Entries whose name
+ *  ends at depth come first and are done.
+ */
+void radixSortNames(listingT *l, listEntryT *entries, listEntryT *scratch, long count, int depth)
+{
+    long counts[256], starts[256], i;
+    int b;
+
+    while (count >= INSERTION_SORT_SIZE)
+    {
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < count; i++)
+        {
+            counts[nameByte(l, &entries[i], depth)]++;
+        }
+
+        /* Every name has the same byte here: look at the next one without moving anything */
+        b = nameByte(l, &entries[0], depth);
+        if (counts[b] == count)
+        {
+            if (b == 0) return;
+            depth++;
+            continue;
+        }
+
+        starts[0] = 0;
+        for (b = 1; b < 256; b++)
+        {
+            starts[b] = starts[b - 1] + counts[b - 1];
+        }
+        for (i = 0; i < count; i++)
+        {
+            scratch[starts[nameByte(l, &entries[i], depth)]++] = entries[i];
+        }
+        memcpy(entries, scratch, count * sizeof(listEntryT));
+
+        for (b = 1, i = counts[0]; b < 256; i += counts[b++])
+        {
+            if (counts[b] > 1) radixSortNames(l, entries + i, scratch + i, counts[b], depth + 1);
+        }
+        return;
+    }
+
+    insertionSort(l, entries, count, depth);
+}
+
+/*  Sort entries by their keys, 8 bits at a time from the lowest, keeping the
+ *  order of equal keys. Returns the array of the two that ends up sorted.
+ */
+listEntryT *radixSortKeys(listEntryT *entries, listEntryT *scratch, long count)
+{
+    long counts[256], starts[256], i;
+    listEntryT *swap;
+    int shift, b;
+
+    for (shift = 0; shift < 64; shift += 8)
+    {
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < count; i++)
+        {
+            counts[entries[i].key >> shift & 0xff]++;
+        }
+
+        /* Skip the bytes every key shares */
+        if (counts[entries[0].key >> shift & 0xff] == count) continue;
+
+        starts[0] = 0;
+        for (b = 1; b < 256; b++)
+        {
+            starts[b] = starts[b - 1] + counts[b - 1];
+        }
+        for (i = 0; i < count; i++)
+        {
+            scratch[starts[entries[i].key >> shift & 0xff]++] = entries[i];
+        }
+        swap = entries;
+        entries = scratch;
+        scratch = swap;
+    }
+
+    return entries;
+}
+
+/* Sort the entries in the arena in the order of the listing */
+void sortListing(listingT *l)
+{
+    listEntryT *scratch;
+    long count = l->numEntries;
+
+    if (l->sortBy == SORT_NONE || count < 2) return;
+    if ((scratch = malloc(count * sizeof(listEntryT))) == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    radixSortNames(l, l->entries, scratch, count, 0);
+    if (l->sortBy != SORT_NAME && radixSortKeys(l->entries, scratch, count) == scratch)
+    {
+        memcpy(l->entries, scratch, count * sizeof(listEntryT));
+    }
+
+    free(scratch);
+}
+
+/* Write the sorted arena to a temporary file as a run and empty the arena */
+void spillRun(listingT *l)
+{
+    runRecordT record;
+    listEntryT *e;
+    FILE *file;
+    long i;
+
+    sortListing(l);
+    if ((file = tmpfile()) == NULL)
+    {
+        perror("tmpfile");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&record, 0, sizeof(record));
+    for (i = 0; i < l->numEntries; i++)
+    {
+        e = &l->entries[i];
+        record.prefix = e->prefix;
+        record.key = e->key;
+        record.length = e->length;
+        record.hasInfo = e->info != -1;
+        if (record.hasInfo) record.info = l->infos[e->info];
+
+        if (fwrite(&record, sizeof(record), 1, file) != 1 ||
+            fwrite(l->names + e->name, 1, e->length, file) != (size_t) e->length)
+        {
+            perror("fwrite");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    l->runs = realloc(l->runs, (l->numRuns + 1) * sizeof(runCursorT));
+    if (l->runs == NULL)
+    {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    l->runs[l->numRuns++].file = file;
+
+    l->namesLength = 0;
+    l->numEntries = 0;
+    l->numInfos = 0;
+}
+
+/*  Get the bytes the listing has allocated: the names, the records and as
+ *  many again for the scratch space of the sort, the statistics, and what
+ *  the caller reserved
+ */
+long listingSize(listingT *l)
+{
+    return l->reserved + l->namesCapacity + 2 * l->entriesCapacity * sizeof(listEntryT) +
+           l->infosCapacity * sizeof(fileInfoT);
+}
+
+/* Get the bytes an array of elements of the given size grows by to hold needed elements */
+long growthOf(long needed, long capacity, size_t size)
+{
+    return (grownCapacity(needed, capacity) - capacity) * size;
+}
+
+/* Add an entry to the listing, with its statistics if they were looked up, writing out a run first if over budget */
+void addEntry(listingT *l, const char *name, int length, const fileInfoT *info)
+{
+    int keep = l->keepInfo && info != NULL;
+    listEntryT *e;
+
+    /* Write out the arena rather than grow its arrays past the budget */
+    if (l->numEntries > 0 &&
+        listingSize(l) + growthOf(l->namesLength + length, l->namesCapacity, 1) +
+        growthOf(l->numEntries + 1, l->entriesCapacity, 2 * sizeof(listEntryT)) +
+        (keep ? growthOf(l->numInfos + 1, l->infosCapacity, sizeof(fileInfoT)) : 0) > MEMORY_BUDGET)
+    {
+        spillRun(l);
+    }
+
+    l->names = growArray(l->names, l->namesLength + length, &l->namesCapacity, 1);
+    l->entries = growArray(l->entries, l->numEntries + 1, &l->entriesCapacity, sizeof(listEntryT));
+
+    e = &l->entries[l->numEntries++];
+    e->prefix = namePrefix(name, length);
+    e->key = info != NULL ? sortKey(l, info) : l->added;
+    e->name = l->namesLength;
+    e->length = length;
+    e->info = -1;
+    memcpy(l->names + l->namesLength, name, length);
+    l->namesLength += length;
+    l->added++;
+
+    if (keep)
+    {
+        l->infos = growArray(l->infos, l->numInfos + 1, &l->infosCapacity, sizeof(fileInfoT));
+        l->infos[l->numInfos] = *info;
+        e->info = l->numInfos++;
+    }
+}
+
+/* Read the next entry of a run into its cursor. Returns 0 at the end of the run. */
+int readRun(runCursorT *run)
+{
+    if (fread(&run->record, sizeof(runRecordT), 1, run->file) != 1) return 0;
+    if (fread(run->name, 1, run->record.length, run->file) != (size_t) run->record.length)
+    {
+        perror("fread");
+        exit(EXIT_FAILURE);
+    }
+
+    return 1;
+}
+
+/* Compare the next entries of two runs in the order of the listing */
+int compareRuns(listingT *l, runCursorT *a, runCursorT *b)
+{
+    if (l->sortBy != SORT_NAME && a->record.key != b->record.key)
+    {
+        return a->record.key < b->record.key ? -1 : 1;
+    }
+
+    return compareNames(a->name, a->record.length, b->name, b->record.length);
+}
+
+/* Move the run at position i down the heap to its place */
+void siftRun(listingT *l, int i)
+{
+    runCursorT run = l->runs[i];
+    int child;
+
+    while ((child = 2 * i + 1) < l->heapSize)
+    {
+        if (child + 1 < l->heapSize && compareRuns(l, &l->runs[child + 1], &l->runs[child]) < 0) child++;
+        if (compareRuns(l, &run, &l->runs[child]) <= 0) break;
+        l->runs[i] = l->runs[child];
+        i = child;
+    }
+    l->runs[i] = run;
+}
+
+/*  Sort what is left in the arena, once all entries are added. If runs were
+ *  written out, the rest is written out too and the runs are set up to be
+ *  merged.
+ */
+void finishListing(listingT *l)
+{
+    int i;
+
+    if (l->numRuns == 0)
+    {
+        sortListing(l);
+        return;
+    }
+
+    if (l->numEntries > 0) spillRun(l);
+    for (i = 0; i < l->numRuns; i++)
+    {
+        rewind(l->runs[i].file);
+        if (!readRun(&l->runs[i]))
+        {
+            perror("fread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    l->heapSize = l->numRuns;
+    for (i = l->heapSize / 2 - 1; i >= 0; i--) siftRun(l, i);
+}
+
+/* Get the next entry of the finished listing. Returns 0 after the last one. */
+int nextListed(listingT *l, const char **name, int *length, const fileInfoT **info)
+{
+    listEntryT *e;
+    runCursorT *top;
+
+    if (l->numRuns == 0)
+    {
+        if (l->next == l->numEntries) return 0;
+
+        e = &l->entries[l->next++];
+        *name = l->names + e->name;
+        *length = e->length;
+        *info = e->info != -1 ? &l->infos[e->info] : NULL;
+        return 1;
+    }
+
+    if (l->heapSize == 0) return 0;
+
+    /* Take the smallest entry of the runs, then move its run on */
+    top = &l->runs[0];
+    l->current = top->record;
+    memcpy(l->currentName, top->name, top->record.length);
+    if (!readRun(top))
+    {
+        fclose(top->file);
+        l->runs[0] = l->runs[--l->heapSize];
+    }
+    siftRun(l, 0);
+
+    *name = l->currentName;
+    *length = l->current.length;
+    *info = l->current.hasInfo ? &l->current.info : NULL;
+    return 1;
+}
+
+/* Free the arena and the runs */
+void freeListing(listingT *l)
+{
+    free(l->names);
+    free(l->entries);
+    free(l->infos);
+    free(l->runs);
+}
+
+#endif
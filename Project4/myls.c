@@ -2,123 +2,625 @@
  *
  *  This program emulates the ls command in linux with limited functionality.
  *
- *  Usage: ./myls [-l] [<dirname>]
+ *  Usage: ./myls [-lStU1C] [<dirname>]
+ *
+ *  Entries are sorted by name unless -t (newest first), -S (largest first)
+ *  or -U (directory order) is given, and laid out in columns when written to
+ *  a terminal unless -1 or -l is given, or -C asks for columns anyway.
  *
  *  Author: Asmit De | U72377278
  *  Date: 03/29/2016
  */
 
+#define _GNU_SOURCE
+
 #include <dirent.h>
+#include <fcntl.h>
 #include <grp.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
-#define BUFFER_SIZE 1024
+#include "listing.h"
+#include "statbatch.h"
+
 #define TIME_SIZE 13
 
-int main(int argc, char *argv[])
+/* Size of the output buffer, and the room it keeps for the longest line */
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define LINE_SIZE 1024
+
+/* Number of slots of the owner and group name caches, a power of 2, and the longest name kept */
+#define NAME_CACHE_SIZE 1024
+#define NAME_SIZE 256
+
+/* Number of minutes whose formatted time is kept, a power of 2 */
+#define TIME_CACHE_SIZE 64
+
+/* Width of the narrowest column, a name of one character and the space after it */
+#define MIN_COLUMN_WIDTH 3
+
+/* Size of the buffer filled with entries by each getdents64 call */
+#define DIRENT_BUFFER_SIZE (1 << 20)
+
+/* Fields of the file statistics used by the long listing */
+#define LONG_LIST_MASK (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | \
+                        STATX_GID | STATX_SIZE | STATX_MTIME)
+
+/* Names of owners or groups by id, found with getpwuid() or getgrgid() at most once each */
+typedef struct nameCache
+{
+    unsigned int ids[NAME_CACHE_SIZE];
+    char *names[NAME_CACHE_SIZE];
+    char spare[NAME_SIZE];
+    int count;
+} nameCacheT;
+
+/* Formatted modification times by the minute they fall in */
+typedef struct timeCache
+{
+    long long minutes[TIME_CACHE_SIZE];
+    char times[TIME_CACHE_SIZE][TIME_SIZE];
+    int lengths[TIME_CACHE_SIZE];
+} timeCacheT;
+
+/* Output collected and written to stdout in large blocks, with the caches used to format it */
+typedef struct output
+{
+    char *buffer;
+    int length;
+    nameCacheT owners, groups;
+    timeCacheT times;
+} outputT;
+
+/* Directory entry as returned by getdents64 */
+typedef struct linuxDirent
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} linuxDirentT;
+
+/* Directory whose entries are read many at a time into a large buffer */
+typedef struct dirReader
+{
+    int fd;
+    char *buffer;
+    long position, end;
+} dirReaderT;
+
+/* Open a directory for reading and handle errors */
+void openDirReader(dirReaderT *reader, const char *path)
+{
+    if ((reader->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+    {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    
+    if ((reader->buffer = malloc(DIRENT_BUFFER_SIZE)) == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    reader->position = 0;
+    reader->end = 0;
+}
+
+/*  Fill the buffer with the next entries of the directory, replacing the
+ *  previous ones. Returns 0 after the last entry.
+ */
+int fillDirReader(dirReaderT *reader)
+{
+    long bytesRead;
+    
+    if ((bytesRead = syscall(SYS_getdents64, reader->fd, reader->buffer, DIRENT_BUFFER_SIZE)) == -1)
+    {
+        perror("getdents64");
+        exit(EXIT_FAILURE);
+    }
+    
+    reader->position = 0;
+    reader->end = bytesRead;
+    
+    return bytesRead > 0;
+}
+
+/* Get the next entry in the buffer. Returns NULL once it is used up. */
+linuxDirentT *nextEntry(dirReaderT *reader)
+{
+    linuxDirentT *entry;
+    
+    if (reader->position == reader->end) return NULL;
+    
+    entry = (linuxDirentT *) (reader->buffer + reader->position);
+    reader->position += entry->d_reclen;
+    
+    return entry;
+}
+
+void closeDirReader(dirReaderT *reader)
+{
+    close(reader->fd);
+    free(reader->buffer);
+}
+
+/*  Check whether the short listing needs the statistics of an entry. Like
+ *  stat(), it leaves out symbolic links that lead nowhere, so only links and
+ *  entries of a type the filesystem does not report need a look; any other
+ *  entry is known to exist from the directory alone.
+ */
+int needsStat(linuxDirentT *entry)
+{
+    return entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN;
+}
+
+/* Write the output collected so far to stdout and handle errors */
+void flushOutput(outputT *out)
+{
+    ssize_t written;
+    int position = 0;
+    
+    while (position < out->length)
+    {
+        if ((written = write(STDOUT_FILENO, out->buffer + position, out->length - position)) == -1)
+        {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        position += written;
+    }
+    out->length = 0;
+}
+
+/* Make room for one more line in the output. Returns where it goes. */
+char *startLine(outputT *out)
+{
+    if (out->length > OUTPUT_BUFFER_SIZE - LINE_SIZE) flushOutput(out);
+    return out->buffer + out->length;
+}
+
+/* Copy length characters into the output. Returns the end. */
+char *appendText(char *end, const char *text, int length)
+{
+    memcpy(end, text, length);
+    return end + length;
+}
+
+/* Write an unsigned number in decimal. Returns the end. */
+char *appendNumber(char *end, unsigned long long value)
+{
+    char digits[24];
+    int n = 0;
+    
+    do
+    {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    
+    while (n > 0) *end++ = digits[--n];
+    return end;
+}
+
+/* Write the file type and permissions as ls does. Returns the end. */
+char *appendPermissions(char *end, unsigned int mode)
+{
+    static const char bits[] = "rwxrwxrwx";
+    int i;
+    
+    *end++ = S_ISDIR(mode) ? 'd' : '-';
+    for (i = 0; i < 9; i++)
+    {
+        *end++ = mode & (0400 >> i) ? bits[i] : '-';
+    }
+    
+    return end;
+}
+
+/*  Get the name of an owner (isGroup 0) or group (isGroup 1) from the
+ *  cache, looking it up on first use. An id without a name is shown as a
+ *  number, as ls does.
+ */
+const char *cachedName(nameCacheT *cache, unsigned int id, int isGroup)
 {
-    struct stat fileInfo;
-    struct dirent *dirEntry;
     struct passwd *owner;
     struct group *grp;
-    struct tm *timestamp;
-    DIR *directory;
-    int longList = 0;
-    char permissions[11], pwd[BUFFER_SIZE], filePath[BUFFER_SIZE], time[TIME_SIZE];
+    const char *name = NULL;
+    char number[16];
+    unsigned int slot = id * 2654435761u & (NAME_CACHE_SIZE - 1);
+    
+    while (cache->names[slot] != NULL)
+    {
+        if (cache->ids[slot] == id) return cache->names[slot];
+        slot = (slot + 1) & (NAME_CACHE_SIZE - 1);
+    }
+    
+    if (isGroup)
+    {
+        if ((grp = getgrgid(id)) != NULL) name = grp->gr_name;
+    }
+    else
+    {
+        if ((owner = getpwuid(id)) != NULL) name = owner->pw_name;
+    }
+    if (name == NULL)
+    {
+        *appendNumber(number, id) = '\0';
+        name = number;
+    }
+    
+    /* Keep the table at most half full, and any further name only until the next lookup */
+    if (cache->count >= NAME_CACHE_SIZE / 2)
+    {
+        snprintf(cache->spare, NAME_SIZE, "%s", name);
+        return cache->spare;
+    }
+    if ((cache->names[slot] = strndup(name, NAME_SIZE - 1)) == NULL)
+    {
+        perror("strndup");
+        exit(EXIT_FAILURE);
+    }
+    cache->ids[slot] = id;
+    cache->count++;
     
+    return cache->names[slot];
+}
+
+/*  Write a modification time as "%b %e %R" in local time. Files modified in
+ *  the same minute share the text, so localtime_r() and strftime() only run
+ *  once per minute seen. Returns the end.
+ */
+char *appendTime(char *end, timeCacheT *cache, time_t modified)
+{
+    struct tm timestamp;
+    long long minute = modified >= 0 ? modified / 60 : (modified - 59) / 60;
+    int slot = minute & (TIME_CACHE_SIZE - 1);
+    
+    if (cache->minutes[slot] != minute || cache->lengths[slot] == 0)
+    {
+        localtime_r(&modified, &timestamp);
+        cache->lengths[slot] = strftime(cache->times[slot], TIME_SIZE, "%b %e %R", &timestamp);
+        cache->minutes[slot] = minute;
+    }
+    
+    return appendText(end, cache->times[slot], cache->lengths[slot]);
+}
+
+/* Keep the statistics the listing shows or sorts by */
+void toFileInfo(fileInfoT *info, struct statx *fileInfo)
+{
+    info->mode = fileInfo->stx_mode;
+    info->nlink = fileInfo->stx_nlink;
+    info->uid = fileInfo->stx_uid;
+    info->gid = fileInfo->stx_gid;
+    info->size = fileInfo->stx_size;
+    info->mtime = fileInfo->stx_mtime.tv_sec;
+    info->mtimeNsec = fileInfo->stx_mtime.tv_nsec;
+}
 
-    /* Check if the second argument is the long list option */
-    if (argc > 1 && !strcmp(argv[1], "-l"))
+/* Display one entry on its own line, after its statistics for the long listing */
+void appendEntry(outputT *out, const char *entryName, int length, const fileInfoT *info)
+{
+    const char *name;
+    char *end = startLine(out);
+    
+    if (info != NULL)
     {
-        longList = 1;
+        /* Display file permissions */
+        end = appendPermissions(end, info->mode);
+        *end++ = ' ';
+        
+        /* Display reference (link) count for file */
+        end = appendNumber(end, info->nlink);
+        *end++ = ' ';
+        
+        /* Display owner of file */
+        name = cachedName(&out->owners, info->uid, 0);
+        end = appendText(end, name, strlen(name));
+        *end++ = ' ';
+        
+        /* Display group owner of file */
+        name = cachedName(&out->groups, info->gid, 1);
+        end = appendText(end, name, strlen(name));
+        *end++ = ' ';
+        
+        /* Display file size */
+        end = appendNumber(end, info->size);
+        *end++ = ' ';
+        
+        /* Display last modified time for file */
+        end = appendTime(end, &out->times, info->mtime);
+        *end++ = ' ';
     }
     
-    if (argc == 1 || (argc == 2 && longList == 1)) /* No directory name specified */
+    /* Display the entry */
+    end = appendText(end, entryName, length);
+    *end++ = '\n';
+    out->length = end - out->buffer;
+}
+
+/* Get the width of the terminal, or else of the COLUMNS variable, or else 80 */
+int terminalWidth()
+{
+    struct winsize size;
+    char *columns;
+    
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) return size.ws_col;
+    if ((columns = getenv("COLUMNS")) != NULL && atoi(columns) > 0) return atoi(columns);
+    
+    return 80;
+}
+
+/*  Display the sorted entries in as many columns as fit the width, filled
+ *  top to bottom as ls does. Every number of columns is tried in the same
+ *  single pass over the names: each keeps the width of its columns, which
+ *  are as wide as their longest name and two spaces, and drops out once its
+ *  lines grow too long.
+ */
+void appendColumns(outputT *out, listingT *l, int width)
+{
+    long numEntries = l->numEntries, rows, i;
+    int maxColumns = width / MIN_COLUMN_WIDTH, columns, column, length;
+    int *widths, *lineWidths;
+    char *fits;
+    listEntryT *e;
+    char *end;
+    
+    if (numEntries == 0) return;
+    if (maxColumns > numEntries) maxColumns = numEntries;
+    if (maxColumns < 1) maxColumns = 1;
+    
+    /* The widths of the columns of a layout of c columns start at c * (c - 1) / 2 */
+    widths = calloc((long) maxColumns * (maxColumns + 1) / 2, sizeof(int));
+    lineWidths = calloc(maxColumns + 1, sizeof(int));
+    fits = malloc(maxColumns + 1);
+    if (widths == NULL || lineWidths == NULL || fits == NULL)
     {
-        /* Get the current working directory and handle errors */
-        if (getcwd(pwd, BUFFER_SIZE - 1) == NULL)
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memset(fits, 1, maxColumns + 1);
+    
+    for (i = 0; i < numEntries; i++)
+    {
+        for (columns = 1; columns <= maxColumns; columns++)
+        {
+            if (!fits[columns]) continue;
+            
+            rows = (numEntries + columns - 1) / columns;
+            column = i / rows;
+            length = l->entries[i].length + (column == columns - 1 ? 0 : 2);
+            if (length > widths[columns * (columns - 1) / 2 + column])
+            {
+                lineWidths[columns] += length - widths[columns * (columns - 1) / 2 + column];
+                widths[columns * (columns - 1) / 2 + column] = length;
+                if (lineWidths[columns] >= width && columns > 1) fits[columns] = 0;
+            }
+        }
+    }
+    
+    for (columns = maxColumns; !fits[columns]; columns--);
+    rows = (numEntries + columns - 1) / columns;
+    
+    for (i = 0; i < rows; i++)
+    {
+        for (column = 0; column < columns && column * rows + i < numEntries; column++)
+        {
+            e = &l->entries[column * rows + i];
+            end = appendText(startLine(out), l->names + e->name, e->length);
+            
+            /* Pad to the next column, if there is an entry in it */
+            if ((column + 1) * rows + i < numEntries)
+            {
+                for (length = e->length; length < widths[columns * (columns - 1) / 2 + column]; length++)
+                {
+                    *end++ = ' ';
+                }
+            }
+            out->length = end - out->buffer;
+        }
+        *startLine(out) = '\n';
+        out->length++;
+    }
+    
+    free(widths);
+    free(lineWidths);
+    free(fits);
+}
+
+int main(int argc, char *argv[])
+{
+    struct statx *fileInfo;
+    linuxDirentT *dirEntry, **entries = NULL;
+    statRequestT *requests = NULL;
+    static outputT out;
+    fileInfoT info;
+    const fileInfoT *listedInfo;
+    listingT listing;
+    dirReaderT directory;
+    int longList = 0, columns, sortBy = SORT_NAME, streaming, option;
+    int numEntries, numRequests, capacity = 0, i, length, *requestOf = NULL;
+    unsigned int mask;
+    const char *pwd, *name;
+    
+    /* Columns are only the default on a terminal */
+    columns = isatty(STDOUT_FILENO);
+    
+    /* Parse the options and handle errors */
+    while ((option = getopt(argc, argv, "lStU1C")) != -1)
+    {
+        switch (option)
         {
-            perror("getcwd");
+        case 'l':
+            longList = 1;
+            break;
+        case 'S':
+            sortBy = SORT_SIZE;
+            break;
+        case 't':
+            sortBy = SORT_TIME;
+            break;
+        case 'U':
+            sortBy = SORT_NONE;
+            break;
+        case '1':
+            columns = 0;
+            break;
+        case 'C':
+            columns = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-lStU1C] [<dirname>]\n", argv[0]);
             exit(EXIT_FAILURE);
         }
     }
+    if (longList) columns = 0;
+    
+    if (optind == argc) /* No directory name specified */
+    {
+        /* Use the current working directory */
+        pwd = ".";
+    }
     else /* Directory name specified */
     {
         /* Set the working directory to the specified directory */
-        strcpy(pwd, argv[argc - 1]);
+        pwd = argv[optind];
     }
     
-    /* Open directory for reading and handle errors */
-    if ((directory = opendir(pwd)) == NULL)
+    /*  Open directory for reading. Entries are looked up relative to it, so
+     *  the kernel does not walk the full path again for every entry.
+     */
+    openDirReader(&directory, pwd);
+    mask = longList ? LONG_LIST_MASK : sortBy == SORT_TIME ? STATX_MTIME :
+           sortBy == SORT_SIZE ? STATX_SIZE : 0;
+    
+    /*  Entries in directory order go straight out, one per line, and any
+     *  other listing is gathered first
+     */
+    streaming = sortBy == SORT_NONE && !columns;
+    initListing(&listing, sortBy, longList);
+    
+    /* The listing shares the memory budget with the buffers and the arrays of entries of this loop */
+    listing.reserved = DIRENT_BUFFER_SIZE + OUTPUT_BUFFER_SIZE;
+    
+    /* Read the time zone once rather than on every localtime() */
+    tzset();
+    if ((out.buffer = malloc(OUTPUT_BUFFER_SIZE)) == NULL)
     {
-        perror("opendir");
+        perror("malloc");
         exit(EXIT_FAILURE);
     }
     
-    /* Iterate over all the entries in the directory structure */
-    while ((dirEntry = readdir(directory)) != NULL)
+    /* Iterate over the entries in the directory structure, one buffer at a time */
+    while (fillDirReader(&directory))
     {
-        /* Skip the hidden files and entries for current and previous directories */
-        if (dirEntry->d_name[0] == '.') continue;
-        
-        /* Extract file statictics and handle errors */
-        sprintf(filePath, "%s/%s", pwd, dirEntry->d_name);
-        if (stat(filePath, &fileInfo) == -1)
+        /*  Gather the entries of the buffer and the ones whose statistics are
+         *  needed. The short listing in name or directory order skips those
+         *  whenever d_type is enough.
+         */
+        numEntries = 0;
+        numRequests = 0;
+        while ((dirEntry = nextEntry(&directory)) != NULL)
         {
-            perror("stat");
-            continue;
+            /* Skip the hidden files and entries for current and previous directories */
+            if (dirEntry->d_name[0] == '.') continue;
+            
+            if (numEntries == capacity)
+            {
+                capacity = capacity ? 2 * capacity : 1024;
+                entries = realloc(entries, capacity * sizeof(linuxDirentT *));
+                requestOf = realloc(requestOf, capacity * sizeof(int));
+                requests = realloc(requests, capacity * sizeof(statRequestT));
+                if (entries == NULL || requestOf == NULL || requests == NULL)
+                {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+                listing.reserved = DIRENT_BUFFER_SIZE + OUTPUT_BUFFER_SIZE +
+                    capacity * (sizeof(linuxDirentT *) + sizeof(int) + sizeof(statRequestT));
+            }
+            
+            requestOf[numEntries] = -1;
+            if (mask != 0 || needsStat(dirEntry))
+            {
+                requestOf[numEntries] = numRequests;
+                requests[numRequests++].name = dirEntry->d_name;
+            }
+            entries[numEntries++] = dirEntry;
         }
         
-        /* Print the long listing if option is given */
-        if (longList == 1)
+        /* Extract only the file statictics needed, all at once */
+        statBatch(directory.fd, requests, numRequests, mask, AT_STATX_SYNC_AS_STAT);
+        
+        for (i = 0; i < numEntries; i++)
         {
-            /* Display file permissions */
-            permissions[0] = (S_ISDIR(fileInfo.st_mode)) ? 'd' : '-';
-            permissions[1] = (fileInfo.st_mode & S_IRUSR) ? 'r' : '-';
-            permissions[2] = (fileInfo.st_mode & S_IWUSR) ? 'w' : '-';
-            permissions[3] = (fileInfo.st_mode & S_IXUSR) ? 'x' : '-';
-            permissions[4] = (fileInfo.st_mode & S_IRGRP) ? 'r' : '-';
-            permissions[5] = (fileInfo.st_mode & S_IWGRP) ? 'w' : '-';
-            permissions[6] = (fileInfo.st_mode & S_IXGRP) ? 'x' : '-';
-            permissions[7] = (fileInfo.st_mode & S_IROTH) ? 'r' : '-';
-            permissions[8] = (fileInfo.st_mode & S_IWOTH) ? 'w' : '-';
-            permissions[9] = (fileInfo.st_mode & S_IXOTH) ? 'x' : '-';
-            permissions[10] = '\0';
-            printf("%s ", permissions);
-            
-            /* Display reference (link) count for file */
-            printf("%ld ", (long) fileInfo.st_nlink);
-            
-            /* Display owner of file */
-            owner = getpwuid(fileInfo.st_uid);
-            printf("%s ", owner->pw_name);
-            
-            /* Display group owner of file */
-            grp = getgrgid(fileInfo.st_gid);
-            printf("%s ", grp->gr_name);
+            dirEntry = entries[i];
             
-            /* Display file size */
-            printf("%lld ", (long long) fileInfo.st_size);
+            /* Handle errors */
+            if (requestOf[i] != -1 && requests[requestOf[i]].error != 0)
+            {
+                errno = requests[requestOf[i]].error;
+                perror("statx");
+                continue;
+            }
+            fileInfo = requestOf[i] != -1 ? &requests[requestOf[i]].info : NULL;
+            if (fileInfo != NULL) toFileInfo(&info, fileInfo);
             
-            /* Display last modified time for file */
-            timestamp = localtime(&fileInfo.st_mtime);
-            strftime(time, TIME_SIZE, "%b %e %R", timestamp);
-            printf("%s ", time);
+            if (streaming)
+            {
+                appendEntry(&out, dirEntry->d_name, strlen(dirEntry->d_name), longList ? &info : NULL);
+            }
+            else
+            {
+                addEntry(&listing, dirEntry->d_name, strlen(dirEntry->d_name), fileInfo != NULL ? &info : NULL);
+            }
+        }
+    }
+    
+    /*  Display the gathered entries in order. A listing too large for memory
+     *  comes back merged from its runs, one per line, since the columns
+     *  would need every name at once.
+     */
+    if (!streaming)
+    {
+        finishListing(&listing);
+        if (columns && listing.numRuns == 0)
+        {
+            appendColumns(&out, &listing, terminalWidth());
+        }
+        else
+        {
+            while (nextListed(&listing, &name, &length, &listedInfo))
+            {
+                appendEntry(&out, name, length, longList ? listedInfo : NULL);
+            }
         }
-        
-        /* Display the entry */
-        printf("%s\n", dirEntry->d_name);
     }
     
-     /* Close the directory pointer after finishing read */
-     closedir(directory);
+     /* Write out the rest of the listing */
+     flushOutput(&out);
+     free(out.buffer);
+     freeListing(&listing);
+    
+     /* Close the directory after finishing read */
+     closeDirReader(&directory);
+     free(entries);
+     free(requestOf);
+     free(requests);
+    
+#ifdef BENCH
+    reportStatBatch();
+#endif
     
     return 0;
 }
@@ -4,18 +4,32 @@
  *
  *  Usage: ./mystat <filename1> [<filename2>...]
  *
+ *  The statistics of all the files are looked up in one batch before any
+ *  is displayed, so the lookups overlap instead of waiting on each other.
+ *
  *  Author: Asmit De | U72377278
  *  Date: 03/29/2016
  */
- 
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "statbatch.h"
+
+/* Fields of the file statistics displayed */
+#define STAT_MASK (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO | \
+                   STATX_SIZE | STATX_BLOCKS)
+
 int main(int argc, char *argv[])
 {
-    struct stat fileInfo;
+    struct statx *fileInfo;
+    statRequestT *requests;
     int i;
     char permissions[11];
     unsigned long mode;
@@ -27,49 +41,69 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
     
+    /* Extract the file statictics of all the filenames passed as arguments at once */
+    if ((requests = malloc((argc - 1) * sizeof(statRequestT))) == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 1; i < argc; i++)
+    {
+        requests[i - 1].name = argv[i];
+    }
+    statBatch(AT_FDCWD, requests, argc - 1, STAT_MASK, AT_STATX_SYNC_AS_STAT);
+    
     /* Iterate over all the filenames passed as arguments */
     for (i = 1; i < argc; i++)
     {
-        /* Extract file statictics and handle errors */
-        if (stat(argv[i], &fileInfo) == -1)
+        /* Handle errors */
+        if (requests[i - 1].error != 0)
         {
+            errno = requests[i - 1].error;
             perror("stat");
             continue;
         }
+        fileInfo = &requests[i - 1].info;
         
         /* Display file name */
         printf("  File: `%s'\n", argv[i]);
         
         /* Display file size */
-        printf("Size: %lld\n", (long long) fileInfo.st_size);
+        printf("Size: %lld\n", (long long) fileInfo->stx_size);
         
         /* Display number of blocks allocated for file */
-        printf("Blocks: %lld\n", (long long) fileInfo.st_blocks);
+        printf("Blocks: %lld\n", (long long) fileInfo->stx_blocks);
         
         /* Display reference (link) count for file */
-        printf("Links: %ld\n", (long) fileInfo.st_nlink);
+        printf("Links: %ld\n", (long) fileInfo->stx_nlink);
         
         /* Display file permissions */
         mode = 0;
-        permissions[0] = (S_ISDIR(fileInfo.st_mode)) ? 'd' : '-';
-        permissions[1] = (mode |= fileInfo.st_mode & S_IRUSR) ? 'r' : '-';
-        permissions[2] = (mode |= fileInfo.st_mode & S_IWUSR) ? 'w' : '-';
-        permissions[3] = (mode |= fileInfo.st_mode & S_IXUSR) ? 'x' : '-';
-        permissions[4] = (mode |= fileInfo.st_mode & S_IRGRP) ? 'r' : '-';
-        permissions[5] = (mode |= fileInfo.st_mode & S_IWGRP) ? 'w' : '-';
-        permissions[6] = (mode |= fileInfo.st_mode & S_IXGRP) ? 'x' : '-';
-        permissions[7] = (mode |= fileInfo.st_mode & S_IROTH) ? 'r' : '-';
-        permissions[8] = (mode |= fileInfo.st_mode & S_IWOTH) ? 'w' : '-';
-        permissions[9] = (mode |= fileInfo.st_mode & S_IXOTH) ? 'x' : '-';
+        permissions[0] = (S_ISDIR(fileInfo->stx_mode)) ? 'd' : '-';
+        permissions[1] = (mode |= fileInfo->stx_mode & S_IRUSR) ? 'r' : '-';
+        permissions[2] = (mode |= fileInfo->stx_mode & S_IWUSR) ? 'w' : '-';
+        permissions[3] = (mode |= fileInfo->stx_mode & S_IXUSR) ? 'x' : '-';
+        permissions[4] = (mode |= fileInfo->stx_mode & S_IRGRP) ? 'r' : '-';
+        permissions[5] = (mode |= fileInfo->stx_mode & S_IWGRP) ? 'w' : '-';
+        permissions[6] = (mode |= fileInfo->stx_mode & S_IXGRP) ? 'x' : '-';
+        permissions[7] = (mode |= fileInfo->stx_mode & S_IROTH) ? 'r' : '-';
+        permissions[8] = (mode |= fileInfo->stx_mode & S_IWOTH) ? 'w' : '-';
+        permissions[9] = (mode |= fileInfo->stx_mode & S_IXOTH) ? 'x' : '-';
         permissions[10] = '\0';
-        mode |= (fileInfo.st_mode & S_ISUID) |
-                (fileInfo.st_mode & S_ISGID) |
-                (fileInfo.st_mode & S_ISVTX);
+        mode |= (fileInfo->stx_mode & S_ISUID) |
+                (fileInfo->stx_mode & S_ISGID) |
+                (fileInfo->stx_mode & S_ISVTX);
         printf("Access: (%04lo/%s)\n", (unsigned long) mode, permissions);
         
         /* Display file Inode */
-        printf("Inode: %ld\n\n", (long) fileInfo.st_ino);
+        printf("Inode: %ld\n\n", (long) fileInfo->stx_ino);
     }
     
+    free(requests);
+    
+#ifdef BENCH
+    reportStatBatch();
+#endif
+    
     return 0;
 }
@@ -8,23 +8,113 @@
  *  Date: 03/30/2016
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h> 
 #include <sys/types.h>
 #include <unistd.h>
 
-#define BUFFER_SIZE 1024
 #define NUM_LINES 10
 
+/* Size of the blocks read backwards from the end of the file */
+#define BLOCK_SIZE (1 << 16)
+
+/*  Find where the last numLines lines of a file of the given size start, by
+ *  reading it backwards a block at a time and counting the newlines in each
+ *  block with memrchr(). A newline ending the file ends its last line rather
+ *  than starting a new one, as with tail.
+ */
+off_t findTailStart(int fd, off_t size, int numLines, char *block)
+{
+    off_t end = size, offset;
+    ssize_t bytesRead;
+    char *newline;
+    int newlines = 0, length;
+    
+    /* Check whether the file ends with a newline, which is not counted */
+    if (size > 0)
+    {
+        if (pread(fd, block, 1, size - 1) == -1)
+        {
+            perror("pread");
+            exit(EXIT_FAILURE);
+        }
+        if (block[0] == '\n') end--;
+    }
+    
+    while (end > 0)
+    {
+        /* Read the block before end, aligned to the block size */
+        offset = (end - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        length = end - offset;
+        if ((bytesRead = pread(fd, block, length, offset)) == -1)
+        {
+            perror("pread");
+            exit(EXIT_FAILURE);
+        }
+        if (bytesRead < length) length = bytesRead;
+        
+        /* Count the newlines in it from the end, and stop at the one before the first line wanted */
+        while ((newline = memrchr(block, '\n', length)) != NULL)
+        {
+            if (++newlines == numLines) return offset + (newline - block) + 1;
+            length = newline - block;
+        }
+        end = offset;
+    }
+    
+    /* The file has no more lines than asked for */
+    return 0;
+}
+
+/* Write the file from start up to size to STDOUT, in one sendfile() if possible */
+void writeTail(int fd, off_t start, off_t size, char *block)
+{
+    ssize_t bytes, written, n;
+    
+    while (start < size)
+    {
+        if ((bytes = sendfile(STDOUT_FILENO, fd, &start, size - start)) > 0) continue;
+        if (bytes == 0) return;
+        if (errno != EINVAL && errno != ENOSYS)
+        {
+            perror("sendfile");
+            exit(EXIT_FAILURE);
+        }
+        
+        /* Copy through the block where stdout takes no sendfile() */
+        if ((bytes = pread(fd, block, size - start < BLOCK_SIZE ? size - start : BLOCK_SIZE, start)) == -1)
+        {
+            perror("pread");
+            exit(EXIT_FAILURE);
+        }
+        if (bytes == 0) return;
+        start += bytes;
+        
+        for (written = 0; written < bytes; )
+        {
+            if ((n = write(STDOUT_FILENO, block + written, bytes - written)) == -1)
+            {
+                perror("write");
+                exit(EXIT_FAILURE);
+            }
+            written += n;
+        }
+    }
+}
+
 int main(int argc, char *argv[])
 {
     struct stat fileInfo;
-    int numLines, newlines, bytesRead, fd;
-    char filepath[BUFFER_SIZE], byte[2];
-    off_t offset;
+    int numLines, fd;
+    char *filepath, *block;
+    off_t start;
     
     /* Handle argument errors */
     if (argc < 2)
@@ -50,7 +140,7 @@ int main(int argc, char *argv[])
         }
         
         /* Get the specified filepath */
-        strcpy(filepath, argv[2]);
+        filepath = argv[2];
     }
     else /* Number of lines not specified */
     {
@@ -58,7 +148,7 @@ int main(int argc, char *argv[])
         numLines = NUM_LINES;
         
         /* Get the specified filepath */
-        strcpy(filepath, argv[1]);
+        filepath = argv[1];
     }
     
     /* Open the fie in read mode */
@@ -69,65 +159,24 @@ int main(int argc, char *argv[])
     }
     
     /* Extract file statictics and handle errors */
-    if (stat(filepath, &fileInfo) == -1)
+    if (fstat(fd, &fileInfo) == -1)
     {
-        perror("stat");
+        perror("fstat");
         exit(EXIT_FAILURE);
     }
     
-    /* Initialize variables to start reading from the last character of file */
-    offset = (off_t) fileInfo.st_size;
-    newlines = 0;
-    bytesRead = 0;
-    
-    /* Start reading from the last character of the file keep looping back */
-    while (newlines <= numLines)
+    if ((block = malloc(BLOCK_SIZE)) == NULL)
     {
-        /* Decrement and reposition the read cursur one place back */
-        if(lseek(fd, --offset, SEEK_SET) == -1)
-        {
-            perror("lseek");
-            exit(EXIT_FAILURE);
-        }
-        
-        /* Read a character */
-        if(read(fd, byte, 1) == -1)
-        {
-            perror("read");
-            exit(EXIT_FAILURE);
-        }
-        
-        /* Keep a count of the newlines and the number of bytes read */
-        if (!strcmp(byte, "\n"))
-        {
-            newlines++;
-        }
-        bytesRead++;
-        
-        /* If the cursur has reached the beginning of file, stop reading */
-        if(bytesRead == (int) fileInfo.st_size)
-        {
-            if(lseek(fd, 0, SEEK_SET) == -1)
-            {
-                perror("lseek");
-                exit(EXIT_FAILURE);
-            }
-            
-            break;
-        }
+        perror("malloc");
+        exit(EXIT_FAILURE);
     }
     
-    /* Read each character from this point till EOF and write it to STDOUT */
-    while(read(fd, byte, 1) != 0)
-    {
-        if(write(1, byte, 1) == -1)
-        {
-            perror("write");
-            exit(EXIT_FAILURE);
-        }
-    }
+    /* Find the start of the last lines reading back from the end, and write them out from there */
+    start = findTailStart(fd, fileInfo.st_size, numLines, block);
+    writeTail(fd, start, fileInfo.st_size, block);
     
     /* Close the file */
+    free(block);
     close(fd);
     
     return 0;
@@ -0,0 +1,326 @@
+/*  statbatch.h
+ *
+ *  Batched file statistics for myls and mystat.
+ *
+ *  statBatch() looks up the statistics of many files relative to one
+ *  directory at once. With io_uring it keeps up to STAT_RING_SIZE
+ *  IORING_OP_STATX requests in flight and reaps the completions in whatever
+ *  order the kernel finishes them. Every request carries its index, so each
+ *  result lands in its own slot and the caller reads them back in the
+ *  original order. On kernels without io_uring, or whose io_uring cannot run
+ *  statx (before 5.6), or when compiled with -D STAT_THREADS, a pool of
+ *  STAT_POOL_SIZE threads calls statx on chunks of the files instead, so
+ *  slow metadata round trips still overlap.
+ *
+ *  Compile with -D BENCH to have reportStatBatch() print the entries per
+ *  second of the backend used.
+ */
+
+#ifndef STATBATCH_H
+#define STATBATCH_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Number of statx requests in flight on the ring */
+#define STAT_RING_SIZE 256
+
+/* Number of operations the probe of the ring asks about, the most it answers */
+#define STAT_PROBE_OPS 256
+
+/* Number of threads of the fallback, well above the CPUs since they mostly wait */
+#ifndef STAT_POOL_SIZE
+#define STAT_POOL_SIZE 16
+#endif
+
+/* Number of files a thread of the fallback claims at a time */
+#define STAT_CHUNK 64
+
+/* One file to look up, and its statistics or the error number once done */
+typedef struct statRequest
+{
+    const char *name;
+    struct statx info;
+    int error;
+} statRequestT;
+
+/* Submission and completion rings shared with the kernel */
+typedef struct statRing
+{
+    int fd;
+    unsigned int *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned int *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int entries;
+} statRingT;
+
+/* A batch shared by the threads of the fallback */
+typedef struct statPool
+{
+    int dirfd, flags, count, next;
+    unsigned int mask;
+    statRequestT *requests;
+} statPoolT;
+
+/* The ring, set up on first use, and whether that worked: 1 if so, -1 if io_uring or its statx is missing */
+statRingT _statRing;
+int _statRingReady;
+
+/* Entries looked up and the nanoseconds spent on them, for the report */
+long _statEntries;
+long long _statTime;
+
+/*  Check whether a ring can run IORING_OP_STATX. The kernels from 5.1 to 5.5
+ *  have io_uring but neither statx on it nor the probe, and would fail every
+ *  request with EINVAL.
+ */
+int ringHasStatx(int fd)
+{
+    struct io_uring_probe *probe;
+    int supported;
+
+    probe = calloc(1, sizeof(struct io_uring_probe) + STAT_PROBE_OPS * sizeof(struct io_uring_probe_op));
+    if (probe == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    supported = syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, STAT_PROBE_OPS) == 0 &&
+                probe->last_op >= IORING_OP_STATX &&
+                (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+
+    free(probe);
+    return supported;
+}
+
+/* Set up the ring. Returns 0 if io_uring, or statx on it, is not available. */
+int setupStatRing(statRingT *ring)
+{
+    struct io_uring_params params;
+    size_t sqSize, cqSize;
+    char *sq, *cq;
+
+    memset(&params, 0, sizeof(params));
+    if ((ring->fd = syscall(SYS_io_uring_setup, STAT_RING_SIZE, &params)) == -1) return 0;
+    if (!ringHasStatx(ring->fd))
+    {
+        close(ring->fd);
+        return 0;
+    }
+
+    /* Map the rings, which share one mapping on newer kernels, and the submission entries */
+    sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cqSize > sqSize) sqSize = cqSize;
+        cqSize = sqSize;
+    }
+
+    sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+        {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    ring->sqHead = (unsigned int *) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned int *) (sq + params.sq_off.tail);
+    ring->sqMask = (unsigned int *) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned int *) (sq + params.sq_off.array);
+    ring->cqHead = (unsigned int *) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned int *) (cq + params.cq_off.tail);
+    ring->cqMask = (unsigned int *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+
+    return 1;
+}
+
+/* Look up every file of the batch through the ring */
+void statRing(statRingT *ring, int dirfd, statRequestT *requests, int count,
+              unsigned int mask, int flags)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned int tail, head, index;
+    int submitted = 0, completed = 0, inFlight = 0, pending = 0, rc;
+
+    while (completed < count)
+    {
+        /* Fill the free slots of the submission ring */
+        tail = *ring->sqTail;
+        while (submitted < count && inFlight < (int) ring->entries)
+        {
+            index = tail & *ring->sqMask;
+            sqe = &ring->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dirfd;
+            sqe->addr = (unsigned long) requests[submitted].name;
+            sqe->len = mask;
+            sqe->addr2 = (unsigned long) &requests[submitted].info;
+            sqe->statx_flags = flags;
+            sqe->user_data = submitted;
+            ring->sqArray[index] = index;
+            tail++;
+            submitted++;
+            inFlight++;
+            pending++;
+        }
+        __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+        /* Submit them and wait for at least one completion */
+        if ((rc = syscall(SYS_io_uring_enter, ring->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0)) == -1)
+        {
+            if (errno == EINTR) continue;
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        pending -= rc;
+
+        /* Reap every completion there is, in whatever order */
+        head = *ring->cqHead;
+        while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+        {
+            cqe = &ring->cqes[head & *ring->cqMask];
+            requests[cqe->user_data].error = cqe->res < 0 ? -cqe->res : 0;
+            head++;
+            completed++;
+            inFlight--;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+}
+
+/* Look up chunks of the batch until none is left */
+void statWorker(void *pptr)
+{
+    statPoolT *pool = (statPoolT *) pptr;
+    statRequestT *r;
+    int first, i;
+
+    while ((first = __atomic_fetch_add(&pool->next, STAT_CHUNK, __ATOMIC_RELAXED)) < pool->count)
+    {
+        for (i = first; i < first + STAT_CHUNK && i < pool->count; i++)
+        {
+            r = &pool->requests[i];
+            r->error = statx(pool->dirfd, r->name, pool->flags, pool->mask, &r->info) == -1 ? errno : 0;
+        }
+    }
+}
+
+/* Look up every file of the batch on a pool of threads, or on this one if the batch is small */
+void statPool(int dirfd, statRequestT *requests, int count, unsigned int mask, int flags)
+{
+    statPoolT pool = { dirfd, flags, count, 0, mask, requests };
+    pthread_t threads[STAT_POOL_SIZE];
+    int numThreads = (count + STAT_CHUNK - 1) / STAT_CHUNK, i, rc;
+
+    if (numThreads > STAT_POOL_SIZE) numThreads = STAT_POOL_SIZE;
+    for (i = 1; i < numThreads; i++)
+    {
+        rc = pthread_create(&threads[i], NULL, (void *) &statWorker, (void *) &pool);
+        if (rc != 0)
+        {
+            errno = rc;
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    statWorker(&pool);
+    for (i = 1; i < numThreads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Get the name of the backend statBatch() uses */
+const char *statBackend()
+{
+#ifdef STAT_THREADS
+    return "threads";
+#else
+    return _statRingReady == 1 ? "io_uring" : "threads";
+#endif
+}
+
+/*  Look up the statistics of count files named relative to dirfd, or to the
+ *  working directory with AT_FDCWD, asking statx for mask with flags. Each
+ *  request gets its statistics, or its error number.
+ */
+void statBatch(int dirfd, statRequestT *requests, int count, unsigned int mask, int flags)
+{
+    struct timespec start, end;
+
+    if (count == 0) return;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+#ifdef STAT_THREADS
+    statPool(dirfd, requests, count, mask, flags);
+#else
+    if (_statRingReady == 0)
+    {
+        _statRingReady = setupStatRing(&_statRing) ? 1 : -1;
+    }
+
+    if (_statRingReady == -1)
+    {
+        statPool(dirfd, requests, count, mask, flags);
+    }
+    else
+    {
+        statRing(&_statRing, dirfd, requests, count, mask, flags);
+    }
+#endif
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    _statEntries += count;
+    _statTime += (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec;
+}
+
+/* Print the entries looked up per second by the backend */
+void reportStatBatch()
+{
+    double seconds = _statTime / 1e9;
+
+    fprintf(stderr, "%-8s %10ld entries %10.3f ms %12.1f entries/s\n", statBackend(),
+            _statEntries, seconds * 1e3, seconds > 0 ? _statEntries / seconds : 0.0);
+}
+
+#endif